@@ -0,0 +1,659 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "ide.h"
+#include "interrupt.h"
+#include "page.h"
+#include "pci.h"
+
+void outb(uint16_t _port, uint8_t val);
+uint8_t inb(uint16_t _port);
+
+struct ata_stats ata_stats;
+struct ata_drive ata_drive = { .max_sectors = ATA_MAX_SECTORS };
+
+// Where the primary channel is, see ata_pci_init()
+uint16_t ata_io_base = ATA_IO_LEGACY;
+uint16_t ata_ctl_base = ATA_CTL_LEGACY;
+uint8_t ata_irq_line = ATA_IRQ;
+
+// The transfer the drive is working on, NULL when it's idle. There's only
+// ever one, the drive can't overlap commands.
+static struct ata_request *volatile ata_current;
+static int ata_irq_ready;
+static int ata_unflushed;       // Writes since the last FLUSH CACHE
+static void (*ata_idle)(void);  // See ata_set_idle_hook()
+
+// Bus master DMA, if ata_dma_init() found a controller that can do it.
+// One PRD table is enough since there's only one transfer at a time.
+static uint16_t bm_base;
+static struct ppage *prd_frame;
+static struct prd *prd_table;
+
+static inline void insw(uint16_t port, void *dst, uint32_t words) {
+    asm volatile("cld; rep insw" : "+D"(dst), "+c"(words) : "d"(port) : "memory");
+}
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "dN"(port));
+}
+
+static inline void outsw(uint16_t port, const void *src, uint32_t words) {
+    asm volatile("cld; rep outsw" : "+S"(src), "+c"(words) : "d"(port) : "memory");
+}
+
+// Reading the alternate status port four times gives the drive the 400ns
+// it needs to update the status after a command or data block
+static inline void ata_delay(void) {
+    for (int i = 0; i < 4; i++) inb(ATA_CONTROL);
+}
+
+// Poll until BSY drops, for at most CONFIG_ATA_BSY_SPINS reads. This runs
+// with interrupts off, so a wedged drive mustn't keep us here. Returns the
+// last status, or -1 if the drive is still busy.
+static int ata_wait_bsy(void) {
+    for (uint32_t i = 0; i < CONFIG_ATA_BSY_SPINS; i++) {
+        uint8_t status = inb(ATA_STATUS);
+        if (!(status & ATA_SR_BSY))
+            return status;
+    }
+    return -1;
+}
+
+// Find the PCI IDE controller and where its primary channel is. In legacy
+// mode that's 0x1F0/0x3F6 and IRQ14, what we start out with. A channel in
+// native mode is switched to legacy mode if the controller lets us, and
+// otherwise we use BAR0, BAR1 and the PCI interrupt line. Returns 0 and
+// fills in d, or -1 if there's no controller we can use, in which case the
+// legacy ports are all we have.
+static int ata_pci_init(struct pci_dev *d) {
+    if (pci_find_class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, d) != 0)
+        return -1;
+
+    uint8_t native = PCI_IDE_PRIMARY_NATIVE | PCI_IDE_PRIMARY_SWITCH;
+    if ((d->prog_if & native) == native) {
+        uint32_t cls = pci_read(d, PCI_CLASS);
+        pci_write(d, PCI_CLASS, cls & ~((uint32_t)PCI_IDE_PRIMARY_NATIVE << 8));
+        d->prog_if = (pci_read(d, PCI_CLASS) >> 8) & 0xFF;
+    }
+    if (!(d->prog_if & PCI_IDE_PRIMARY_NATIVE))
+        return 0;
+
+    // Stuck in native mode. The command and control blocks must be I/O
+    // BARs, and the device control register is 2 into the control block.
+    uint32_t bar0 = pci_read(d, PCI_BAR0);
+    uint32_t bar1 = pci_read(d, PCI_BAR0 + 4);
+    uint32_t line = pci_read(d, PCI_INTERRUPT_LINE) & 0xFF;
+    if (!(bar0 & 1) || !(bar1 & 1) || (bar0 & ~3) == 0 || (bar1 & ~3) == 0 || line > 15)
+        return -1;
+
+    uint32_t cmd = pci_read(d, PCI_COMMAND);
+    pci_write(d, PCI_COMMAND, (cmd & 0xFFFF) | PCI_CMD_IO);
+    ata_io_base = bar0 & 0xFFFC;
+    ata_ctl_base = (bar1 & 0xFFFC) + 2;
+    ata_irq_line = line;
+    ide_set_irq(line);
+    return 0;
+}
+
+// Set up bus mastering on controller d if it can, and set aside a frame
+// for the PRD table. Leaves bm_base 0 if there's no DMA to be had.
+static void ata_dma_init(struct pci_dev *d) {
+    bm_base = 0;
+    if (!(d->prog_if & PCI_IDE_BUS_MASTER))
+        return;
+
+    // BAR4 is the bus master block, in I/O space
+    uint32_t bar4 = pci_read(d, PCI_BAR0 + 16);
+    if (!(bar4 & 1) || (bar4 & ~3) == 0)
+        return;
+
+    if (prd_frame == NULL) {
+        prd_frame = allocate_physical_pages(1);
+        if (prd_frame == NULL)
+            return;
+        prd_table = P2V(prd_frame->physical_addr);
+    }
+
+    uint32_t cmd = pci_read(d, PCI_COMMAND);
+    pci_write(d, PCI_COMMAND, (cmd & 0xFFFF) | PCI_CMD_IO | PCI_CMD_BUS_MASTER);
+
+    bm_base = bar4 & 0xFFFC;
+    outb(bm_base + BM_COMMAND, 0);
+    outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+}
+
+// Add [phys, phys + len) to the PRD table, which has *n entries so far.
+// Regions are split at 64 KiB boundaries and merged with the previous one
+// where they carry straight on from it. Returns -1 if the table is full.
+static int prd_add(uint32_t *n, uint32_t phys, uint32_t len) {
+    while (len > 0) {
+        uint32_t room = 0x10000 - (phys & 0xFFFF);     // Up to the next boundary
+        uint32_t chunk = len < room ? len : room;
+
+        struct prd *last = (*n > 0) ? &prd_table[*n - 1] : NULL;
+        uint32_t last_len = (last && last->bytes == 0) ? 0x10000 : (last ? last->bytes : 0);
+        if (last && last->phys + last_len == phys && (phys & 0xFFFF) != 0) {
+            last->bytes = (last_len + chunk) & 0xFFFF;
+        } else {
+            if (*n == PRD_MAX)
+                return -1;
+            prd_table[*n].phys = phys;
+            prd_table[*n].bytes = chunk & 0xFFFF;
+            prd_table[*n].flags = 0;
+            (*n)++;
+        }
+        phys += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Describe rq's memory in the PRD table. Returns -1 if it can't be done,
+// e.g. the buffer isn't in the kernel's linear mapping so we don't know
+// where it is physically.
+static int prd_build(struct ata_request *rq) {
+    uint32_t n = 0;
+    uint32_t bytes = rq->count * 512;
+
+    if (rq->frames != NULL) {
+        for (struct ppage *p = rq->frames; bytes > 0; p = p->next) {
+            if (p == NULL)
+                return -1;
+            uint32_t len = bytes < PAGE_SIZE ? bytes : PAGE_SIZE;
+            if (prd_add(&n, (uint32_t)p->physical_addr, len) != 0)
+                return -1;
+            bytes -= len;
+        }
+    } else if (rq->sg != NULL) {
+        for (uint32_t i = 0; i < rq->nsg; i++) {
+            uintptr_t v = (uintptr_t)rq->sg[i].buffer;
+            uint32_t len = rq->sg[i].count * 512;
+            if (v < KERNEL_VIRT_BASE || V2P(v) + len > KERNEL_LOWMEM_LIMIT || (v & 1))
+                return -1;
+            if (prd_add(&n, V2P(v), len) != 0)
+                return -1;
+        }
+    } else {
+        uintptr_t v = (uintptr_t)rq->buffer;
+        if (v < KERNEL_VIRT_BASE || V2P(v) + bytes > KERNEL_LOWMEM_LIMIT || (v & 1))
+            return -1;
+        if (prd_add(&n, V2P(v), bytes) != 0)
+            return -1;
+    }
+    prd_table[n - 1].flags = PRD_EOT;
+    return 0;
+}
+
+// Issue a command that moves no data and poll until the drive is done,
+// with its interrupt masked. Returns 0, or -1 if the drive rejected it.
+static int ata_command_polled(uint8_t command, uint8_t count) {
+    uint8_t status;
+
+    outb(ATA_CONTROL, 2);
+    while (inb(ATA_STATUS) & ATA_SR_BSY)
+        ;
+    outb(ATA_DRIVE, 0xE0);
+    outb(ATA_COUNT, count);
+    outb(ATA_COMMAND, command);
+    ata_delay();
+    while ((status = inb(ATA_STATUS)) & ATA_SR_BSY)
+        ;
+    return (status & (ATA_SR_ERR | ATA_SR_DF)) ? -1 : 0;
+}
+
+// Ask drive 0 what it can do and fill in ata_drive. Polls with the
+// drive's interrupt masked. Returns -1 if nothing answers, or it's not an
+// ATA disk (ATAPI devices abort IDENTIFY DEVICE).
+static int ata_identify(void) {
+    uint16_t id[256];
+    uint8_t status;
+
+    outb(ATA_CONTROL, 2);
+    if (inb(ATA_STATUS) == 0xFF)
+        return -1;      // Floating bus, no drives on this channel
+    while (inb(ATA_STATUS) & ATA_SR_BSY)
+        ;
+    outb(ATA_DRIVE, 0xE0);
+    outb(ATA_COMMAND, ATA_CMD_IDENTIFY);
+    ata_delay();
+    if (inb(ATA_STATUS) == 0)
+        return -1;      // No drive 0
+    while ((status = inb(ATA_STATUS)) & ATA_SR_BSY)
+        ;
+    if ((status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ))
+        return -1;
+    insw(ATA_DATA, id, 256);
+
+    if (!(id[ATA_ID_CAPABILITIES] & 0x200))
+        return -1;      // CHS only
+    ata_drive.dma = (id[ATA_ID_CAPABILITIES] & 0x100) != 0;
+    ata_drive.lba48 = (id[ATA_ID_COMMAND_SET] & 0x400) != 0;
+    ata_drive.max_multiple = id[ATA_ID_MAX_MULTIPLE] & 0xFF;
+    ata_drive.max_sectors = ata_drive.lba48 ? ATA_MAX_SECTORS_EXT : ATA_MAX_SECTORS;
+    if (ata_drive.lba48 && (id[ATA_ID_SECTORS_EXT + 2] | id[ATA_ID_SECTORS_EXT + 3]) != 0)
+        ata_drive.sectors = 0xFFFFFFFF;
+    else if (ata_drive.lba48)
+        ata_drive.sectors = id[ATA_ID_SECTORS_EXT] | ((uint32_t)id[ATA_ID_SECTORS_EXT + 1] << 16);
+    else
+        ata_drive.sectors = id[ATA_ID_SECTORS] | ((uint32_t)id[ATA_ID_SECTORS + 1] << 16);
+
+    // The model string is space padded, with each word's bytes swapped
+    int len = 0;
+    for (int i = 0; i < 20; i++) {
+        ata_drive.model[2 * i] = id[ATA_ID_MODEL + i] >> 8;
+        ata_drive.model[2 * i + 1] = id[ATA_ID_MODEL + i] & 0xFF;
+    }
+    for (int i = 0; i < 40; i++)
+        if (ata_drive.model[i] != ' ') len = i + 1;
+    ata_drive.model[len] = '\0';
+
+    ata_drive.identified = 1;
+    return 0;
+}
+
+// Switch disk I/O over to IRQ14. Call once the IDT is loaded and
+// interrupts are on; until then ata_lba_read() and ata_lba_write() poll.
+void ata_init(void) {
+    struct pci_dev d;
+    int pci = (ata_pci_init(&d) == 0);
+
+    ata_current = NULL;
+
+    // A drive that doesn't identify itself still gets plain LBA28 commands
+    // and DMA if the controller does it, as before we asked
+    ata_drive.dma = 1;
+    if (ata_identify() != 0)
+        ata_drive.identified = 0;
+
+    // PIO transfers move this many sectors per DRQ block, and interrupt,
+    // with READ/WRITE MULTIPLE. Drives that don't take it abort the command
+    // and we stay with one sector at a time.
+    uint32_t multiple = CONFIG_ATA_MULTIPLE;
+    if (ata_drive.identified && multiple > ata_drive.max_multiple)
+        multiple = ata_drive.max_multiple;
+    ata_drive.multiple = 0;
+    if (multiple > 1 && ata_command_polled(ATA_CMD_SET_MULTIPLE, multiple) == 0)
+        ata_drive.multiple = multiple;
+
+    inb(ATA_STATUS);                // Drop anything left pending
+    outb(ATA_CONTROL, 0);           // nIEN off, the drive may interrupt
+    IRQ_clear_mask(2);              // Cascade from the slave PIC
+    IRQ_clear_mask(ata_irq_line);
+    bm_base = 0;
+    if (pci && ata_drive.dma)
+        ata_dma_init(&d);
+    ata_irq_ready = 1;
+}
+
+// Where sector i of rq's data lives in memory
+static uint8_t *ata_sector(const struct ata_request *rq, uint32_t i) {
+    if (rq->sg == NULL)
+        return rq->buffer + i * 512;
+    const struct ata_sg *sg = rq->sg;
+    while (i >= sg->count) {
+        i -= sg->count;
+        sg++;
+    }
+    return sg->buffer + i * 512;
+}
+
+// Move the next DRQ block of a PIO transfer, the last one may be short. A
+// block may span pieces of a scattered request, so go a sector at a time
+// there.
+static void ata_move_block(struct ata_request *rq) {
+    uint32_t n = rq->block;
+    if (n > rq->remaining) n = rq->remaining;
+    uint32_t first = rq->count - rq->remaining;
+    uint32_t step = (rq->sg == NULL) ? n : 1;
+    for (uint32_t i = 0; i < n; i += step) {
+        uint8_t *p = ata_sector(rq, first + i);
+        if (rq->write)
+            outsw(ATA_DATA, p, step * 256);
+        else
+            insw(ATA_DATA, p, step * 256);
+    }
+    rq->remaining -= n;
+}
+
+// Finish the current transfer, from the IRQ handler
+static void ata_complete(struct ata_request *rq, int status) {
+    if (status != 0)
+        ata_stats.errors++;
+    ata_current = NULL;
+    if (rq->flush && status == 0)
+        ata_unflushed = 0;
+    rq->status = status;
+    if (rq->done != NULL)
+        rq->done(rq);
+    if (ata_current == NULL && ata_idle != NULL)
+        ata_idle();
+}
+
+// Have fn called, in interrupt context, whenever a transfer finishes and
+// nothing else has been started on the drive, whoever submitted it. The
+// block queue uses it to carry on once the drive is free.
+void ata_set_idle_hook(void (*fn)(void)) {
+    ata_idle = fn;
+}
+
+// IRQ14. A DMA transfer or a flush is over in one go. Otherwise reads move
+// the DRQ block the drive has ready, writes send the next one, and the
+// interrupt after the last block completes the request.
+void ata_irq(void) {
+    struct ata_request *rq = ata_current;
+
+    ata_stats.irqs++;
+    if (rq != NULL && rq->dma) {
+        uint8_t bm_status = inb(bm_base + BM_STATUS);
+        if (!(bm_status & BM_SR_IRQ)) {
+            inb(ATA_STATUS);
+            ata_stats.spurious++;
+            return;
+        }
+        outb(bm_base + BM_COMMAND, 0);
+        uint8_t status = inb(ATA_STATUS);
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+        rq->remaining = 0;
+        ata_complete(rq, ((bm_status & BM_SR_ERR) || (status & (ATA_SR_ERR | ATA_SR_DF))) ? -1 : 0);
+        return;
+    }
+
+    uint8_t status = inb(ATA_STATUS);
+    if (rq == NULL) {
+        ata_stats.spurious++;
+        return;
+    }
+    if (status & (ATA_SR_ERR | ATA_SR_DF)) {
+        ata_complete(rq, -1);
+        return;
+    }
+
+    if (rq->flush) {
+        ata_complete(rq, 0);
+    } else if (!rq->write) {
+        if (!(status & ATA_SR_DRQ))
+            return;
+        ata_move_block(rq);
+        if (rq->remaining == 0)
+            ata_complete(rq, 0);
+    } else {
+        if (rq->remaining == 0) {
+            ata_complete(rq, 0);
+            return;
+        }
+        if (!(status & ATA_SR_DRQ))
+            return;
+        ata_move_block(rq);
+    }
+}
+
+// Load the task file for a transfer of count sectors at lba. LBA48 takes
+// two writes to each register, the high order byte first.
+static void ata_taskfile(uint32_t lba, uint32_t count, int ext) {
+    if (ext) {
+        outb(ATA_DRIVE, 0x40);                          // LBA mode, drive 0
+        outb(ATA_COUNT, (count >> 8) & 0xFF);            // 0 in both means 65536
+        outb(ATA_LBA_LO, (lba >> 24) & 0xFF);
+        outb(ATA_LBA_MID, 0);                           // Bits 32 - 47 of the LBA
+        outb(ATA_LBA_HI, 0);
+    } else {
+        outb(ATA_DRIVE, 0xE0 | ((lba >> 24) & 0x0F));  // LBA mode, drive 0
+    }
+    outb(ATA_COUNT, count & 0xFF);                      // 0 means 256
+    outb(ATA_LBA_LO, lba & 0xFF);
+    outb(ATA_LBA_MID, (lba >> 8) & 0xFF);
+    outb(ATA_LBA_HI, (lba >> 16) & 0xFF);
+}
+
+static uint8_t ata_opcode(const struct ata_request *rq, int ext) {
+    if (rq->dma) {
+        if (rq->write)
+            return ext ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_WRITE_DMA;
+        return ext ? ATA_CMD_READ_DMA_EXT : ATA_CMD_READ_DMA;
+    }
+    if (rq->block > 1) {
+        if (rq->write)
+            return ext ? ATA_CMD_WRITE_MULTIPLE_EXT : ATA_CMD_WRITE_MULTIPLE;
+        return ext ? ATA_CMD_READ_MULTIPLE_EXT : ATA_CMD_READ_MULTIPLE;
+    }
+    if (rq->write)
+        return ext ? ATA_CMD_WRITE_EXT : ATA_CMD_WRITE;
+    return ext ? ATA_CMD_READ_EXT : ATA_CMD_READ;
+}
+
+// Start rq and return without waiting for it. It goes by DMA if there's a
+// bus master controller and its memory can be described to it; PIO uses
+// READ/WRITE MULTIPLE if the drive took a block size. LBA48 commands are
+// only used where LBA28 can't do it. Returns 0, ATA_BUSY if the drive is
+// on another request, or -1 if rq is empty, too big or out of reach, it
+// wants frames filled and there's no DMA to do it, or the drive stayed
+// busy past CONFIG_ATA_BSY_SPINS.
+int ata_submit(struct ata_request *rq) {
+    int ext = 0;
+
+    if (!rq->flush) {
+        if (rq->count == 0 || rq->count > ata_drive.max_sectors)
+            return -1;
+        ext = (rq->count > ATA_MAX_SECTORS || rq->lba + rq->count > ATA_LBA28_LIMIT);
+        if (ext && !ata_drive.lba48)
+            return -1;
+    }
+
+    // The handler mustn't see the request half set up
+    uint32_t flags = irq_save();
+    if (ata_current != NULL) {
+        irq_restore(flags);
+        return ATA_BUSY;
+    }
+
+    // Don't touch the task file while the drive is still busy
+    if (ata_wait_bsy() < 0) {
+        ata_stats.timeouts++;
+        irq_restore(flags);
+        return -1;
+    }
+
+    if (rq->flush) {
+        rq->dma = 0;
+        rq->remaining = 0;
+        rq->status = ATA_PENDING;
+        ata_current = rq;
+        ata_stats.commands++;
+        ata_stats.flushes++;
+        outb(ATA_DRIVE, 0xE0);
+        outb(ATA_COMMAND, ata_drive.lba48 ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE);
+        irq_restore(flags);
+        return 0;
+    }
+
+    rq->dma = (bm_base != 0 && prd_build(rq) == 0);
+    if (rq->frames != NULL && !rq->dma) {
+        irq_restore(flags);
+        return -1;
+    }
+
+    rq->block = (ata_drive.multiple != 0) ? ata_drive.multiple : 1;
+    if (rq->write)
+        ata_unflushed = 1;
+    rq->remaining = rq->count;
+    rq->status = ATA_PENDING;
+    ata_current = rq;
+    ata_stats.commands++;
+    if (ext)
+        ata_stats.lba48++;
+
+    if (rq->dma) {
+        ata_stats.dma++;
+        outb(bm_base + BM_COMMAND, 0);
+        outl(bm_base + BM_PRDT, (uint32_t)prd_frame->physical_addr);
+        outb(bm_base + BM_STATUS, BM_SR_ERR | BM_SR_IRQ);
+    }
+
+    ata_taskfile(rq->lba, rq->count, ext);
+    outb(ATA_COMMAND, ata_opcode(rq, ext));
+
+    if (rq->dma) {
+        outb(bm_base + BM_COMMAND, BM_CMD_START | (rq->write ? 0 : BM_CMD_READ));
+        irq_restore(flags);
+        return 0;
+    }
+
+    // Writes don't get an interrupt for the first block, the drive just
+    // raises DRQ. Everything after that is interrupt driven.
+    if (rq->write) {
+        int status;
+        ata_delay();
+        status = ata_wait_bsy();
+        if (status < 0)
+            ata_stats.timeouts++;
+        if (status < 0 || (status & (ATA_SR_ERR | ATA_SR_DF)) || !(status & ATA_SR_DRQ)) {
+            ata_complete(rq, -1);
+            irq_restore(flags);
+            return 0;
+        }
+        ata_move_block(rq);
+    }
+    irq_restore(flags);
+    return 0;
+}
+
+// Halt until the drive has nothing to do, e.g. the block queue is done
+// with it. Same trick as ata_wait().
+static void ata_wait_idle(void) {
+    uint32_t flags = irq_save();
+    while (ata_current != NULL)
+        asm volatile("sti; hlt; cli" : : : "memory");
+    irq_restore(flags);
+}
+
+// Halt until rq finishes. Interrupts are off between checking the status
+// and halting, and sti only takes effect after the hlt, so the IRQ can't
+// slip in between and leave us asleep. Interrupts are left as the caller
+// had them. Returns rq's status.
+int ata_wait(struct ata_request *rq) {
+    uint32_t flags = irq_save();
+    while (rq->status == ATA_PENDING)
+        asm volatile("sti; hlt; cli" : : : "memory");
+    irq_restore(flags);
+    return rq->status;
+}
+
+// Start rq once the drive is free, and wait for it
+static int ata_run(struct ata_request *rq) {
+    int r;
+    while ((r = ata_submit(rq)) == ATA_BUSY)
+        ata_wait_idle();
+    if (r != 0)
+        return -1;
+    return ata_wait(rq);
+}
+
+// Have the drive write its cache out to the media, so everything written
+// before this is on disk whatever happens next. Writes are free to sit in
+// the drive's cache until then. Doesn't bother the drive if nothing was
+// written since the last flush. Once the block queue is running use
+// blk_flush() instead, which waits its turn behind queued writes. Returns
+// 0, or -1 on an error.
+int ata_flush(void) {
+    if (!ata_unflushed)
+        return 0;       // Nothing in the drive's cache from us
+
+    int r;
+    if (!ata_irq_ready) {
+        r = ata_command_polled(ATA_CMD_FLUSH_CACHE, 0);
+    } else {
+        struct ata_request rq = {
+            .flush = 1,
+            .done = NULL,
+        };
+        r = ata_run(&rq);
+    }
+    if (r == 0)
+        ata_unflushed = 0;
+    return r;
+}
+
+// Whether anything was written since the last FLUSH CACHE
+int ata_flush_pending(void) {
+    return ata_unflushed;
+}
+
+static int ata_rw(int write, unsigned int lba, unsigned char *buffer, struct ppage *frames, unsigned int numsectors) {
+    struct ata_request rq = {
+        .lba = lba,
+        .buffer = buffer,
+        .frames = frames,
+        .count = numsectors,
+        .write = write,
+        .done = NULL,
+    };
+    return ata_run(&rq);
+}
+
+// Read numsectors sectors from lba into buffer, sleeping while the drive
+// works. Returns 0, or -1 on an error.
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    if (!ata_irq_ready) {
+        if (numsectors == 0 || numsectors > ATA_MAX_SECTORS || lba + numsectors > ATA_LBA28_LIMIT)
+            return -1;
+        return ata_pio_read(lba, buffer, numsectors);
+    }
+    return ata_rw(0, lba, buffer, NULL, numsectors);
+}
+
+int ata_lba_write(unsigned int lba, unsigned char *buffer, unsigned int numsectors) {
+    if (!ata_irq_ready) {
+        if (numsectors == 0 || numsectors > ATA_MAX_SECTORS || lba + numsectors > ATA_LBA28_LIMIT)
+            return -1;
+        ata_unflushed = 1;
+        return ata_pio_write(lba, buffer, numsectors);
+    }
+    return ata_rw(1, lba, buffer, NULL, numsectors);
+}
+
+// Move numsectors sectors between lba and a list of PFA frames, filling
+// each frame before moving on to the next. With DMA the controller
+// scatters straight into the frames, otherwise each goes through
+// ata_lba_read()/ata_lba_write() by its kernel mapping.
+static int ata_frames(int write, unsigned int lba, struct ppage *frames, unsigned int numsectors) {
+    const uint32_t per_frame = PAGE_SIZE / 512;
+    int dma = (ata_irq_ready && bm_base != 0);
+    struct ppage *p = frames;
+
+    while (numsectors > 0) {
+        if (p == NULL)
+            return -1;
+
+        // A whole command's worth of frames at a time by DMA, as many as
+        // the PRD table is sure to hold, one frame at a time otherwise
+        uint32_t n = per_frame;
+        if (dma) {
+            n = ata_drive.max_sectors;
+            if (n > PRD_MAX * per_frame) n = PRD_MAX * per_frame;
+        }
+        if (n > numsectors) n = numsectors;
+
+        int r;
+        if (dma)
+            r = ata_rw(write, lba, NULL, p, n);
+        else if (write)
+            r = ata_lba_write(lba, P2V(p->physical_addr), n);
+        else
+            r = ata_lba_read(lba, P2V(p->physical_addr), n);
+        if (r != 0)
+            return -1;
+
+        lba += n;
+        numsectors -= n;
+        for (uint32_t i = 0; i < n && p != NULL; i += per_frame) p = p->next;
+    }
+    return 0;
+}
+
+int ata_read_frames(unsigned int lba, struct ppage *frames, unsigned int numsectors) {
+    return ata_frames(0, lba, frames, numsectors);
+}
+
+int ata_write_frames(unsigned int lba, struct ppage *frames, unsigned int numsectors) {
+    return ata_frames(1, lba, frames, numsectors);
+}
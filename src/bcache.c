@@ -0,0 +1,335 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "bcache.h"
+#include "kmalloc.h"
+#include "blk.h"
+
+static struct buf bufs[CONFIG_BCACHE_SIZE];
+static struct buf *hash_table[BCACHE_HASH_SIZE];
+
+// Most and least recently used ends of the LRU list
+static struct buf *lru_head = NULL;
+static struct buf *lru_tail = NULL;
+
+static uint32_t num_dirty;
+
+// Run before write backs the cache starts on its own, see
+// bcache_set_presync()
+static int (*presync)(void);
+
+// breadahead() reads a whole run here with one command, then hands the
+// sectors out to buffers
+static uint8_t *ra_buf;
+
+struct bcache_stats bcache_stats;
+
+static inline uint32_t hash_lba(uint32_t lba) {
+    return lba % BCACHE_HASH_SIZE;
+}
+
+static void lru_remove(struct buf *b) {
+    if (b->lru_prev) b->lru_prev->lru_next = b->lru_next;
+    else lru_head = b->lru_next;
+    if (b->lru_next) b->lru_next->lru_prev = b->lru_prev;
+    else lru_tail = b->lru_prev;
+    b->lru_next = NULL;
+    b->lru_prev = NULL;
+}
+
+static void lru_push_head(struct buf *b) {
+    b->lru_prev = NULL;
+    b->lru_next = lru_head;
+    if (lru_head) lru_head->lru_prev = b;
+    else lru_tail = b;
+    lru_head = b;
+}
+
+static void hash_remove(struct buf *b) {
+    struct buf **link = &hash_table[hash_lba(b->lba)];
+    while (*link && *link != b) link = &(*link)->hash_next;
+    if (*link) *link = b->hash_next;
+    b->hash_next = NULL;
+}
+
+static struct buf *hash_lookup(uint32_t lba) {
+    struct buf *b = hash_table[hash_lba(lba)];
+    while (b && !(b->lba == lba && (b->flags & BUF_VALID))) b = b->hash_next;
+    return b;
+}
+
+// Allocate the sector buffers. Returns 0 on success, -1 if we ran out of
+// memory (whatever was allocated so far is still used).
+int bcache_init(void) {
+    for (int i = 0; i < BCACHE_HASH_SIZE; i++) hash_table[i] = NULL;
+    lru_head = NULL;
+    lru_tail = NULL;
+
+    for (int i = 0; i < CONFIG_BCACHE_SIZE; i++) {
+        bufs[i].data = kmalloc(BCACHE_BLOCK_SIZE);
+        if (bufs[i].data == NULL) return -1;
+
+        bufs[i].hash_next = NULL;
+        bufs[i].lba = 0;
+        bufs[i].flags = 0;
+        bufs[i].refcount = 0;
+        lru_push_head(&bufs[i]);
+    }
+
+    ra_buf = kmalloc(BCACHE_BLOCK_SIZE * CONFIG_BCACHE_READAHEAD_MAX);
+    if (ra_buf == NULL) return -1;
+    return 0;
+}
+
+// Count the first use of a buffer breadahead() filled
+static inline void ra_touch(struct buf *b) {
+    if (b->flags & BUF_READAHEAD) {
+        b->flags &= ~BUF_READAHEAD;
+        bcache_stats.ra_hits++;
+    }
+}
+
+// Make b the cached copy of sector lba and the most recently used buffer
+static void buf_fill(struct buf *b, uint32_t lba, uint32_t flags, uint32_t refcount) {
+    b->lba = lba;
+    b->flags = flags;
+    b->refcount = refcount;
+    b->hash_next = hash_table[hash_lba(lba)];
+    hash_table[hash_lba(lba)] = b;
+    lru_remove(b);
+    lru_push_head(b);
+}
+
+// Too many dirty buffers, or no clean one to recycle: write them back. The
+// presync hook goes first, and if it fails nothing is written, so sectors
+// that must not reach the disk before it don't.
+static void bsync_pressure(void) {
+    bcache_stats.pressure++;
+    if (presync != NULL && presync() != 0)
+        return;
+    bsync();
+}
+
+// Find an unused, clean buffer to recycle, starting from the least recently
+// used. If every unused buffer is dirty, write them all back and try again.
+static struct buf *get_free_buf(void) {
+    struct buf *b = NULL;
+    for (b = lru_tail; b != NULL; b = b->lru_prev) {
+        if (b->refcount == 0 && !(b->flags & BUF_DIRTY)) break;
+    }
+    if (b == NULL)
+        bsync_pressure();
+
+    for (b = lru_tail; b != NULL; b = b->lru_prev) {
+        if (b->refcount == 0 && !(b->flags & BUF_DIRTY)) {
+            if (b->flags & BUF_VALID) {
+                hash_remove(b);
+                bcache_stats.evictions++;
+            }
+            if (b->flags & BUF_READAHEAD) bcache_stats.ra_wasted++;
+            b->flags = 0;
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// Get the buffer holding sector lba, reading it from disk if it isn't
+// cached. The caller owns a reference until brelse(). Returns NULL on a
+// disk error or if every buffer is in use.
+struct buf *bread(uint32_t lba) {
+    struct buf *b = hash_lookup(lba);
+    if (b != NULL) {
+        bcache_stats.hits++;
+        ra_touch(b);
+        b->refcount++;
+        lru_remove(b);
+        lru_push_head(b);
+        return b;
+    }
+
+    bcache_stats.misses++;
+    b = get_free_buf();
+    if (b == NULL) return NULL;
+
+    if (blk_read(lba, b->data, 1) != 0) return NULL;
+
+    buf_fill(b, lba, BUF_VALID, 1);
+    return b;
+}
+
+// Like bread(), but only if sector lba is already cached. Returns NULL
+// rather than going to the disk.
+struct buf *bpeek(uint32_t lba) {
+    struct buf *b = hash_lookup(lba);
+    if (b == NULL) return NULL;
+
+    bcache_stats.hits++;
+    ra_touch(b);
+    b->refcount++;
+    lru_remove(b);
+    lru_push_head(b);
+    return b;
+}
+
+// Get a buffer for sector lba without reading it, for when the caller is
+// about to overwrite the whole sector. Unless it was already cached, the
+// data is garbage until the caller fills it in and calls bdirty(). Returns
+// NULL if every buffer is in use.
+struct buf *bget(uint32_t lba) {
+    struct buf *b = bpeek(lba);
+    if (b != NULL) return b;
+
+    b = get_free_buf();
+    if (b == NULL) return NULL;
+    buf_fill(b, lba, BUF_VALID, 1);
+    return b;
+}
+
+// Is sector lba cached? Doesn't count as a use.
+int bcached(uint32_t lba) {
+    return hash_lookup(lba) != NULL;
+}
+
+// Bring the count sectors from lba into the cache ahead of being asked for.
+// Runs that aren't cached yet are read with one command each, at most
+// CONFIG_BCACHE_READAHEAD_MAX sectors at a time. The buffers aren't held
+// by anyone. Returns the number of sectors read, or -1 on a disk error.
+int breadahead(uint32_t lba, uint32_t count) {
+    uint32_t total = 0;
+    uint32_t end = lba + count;
+
+    while (lba < end) {
+        if (hash_lookup(lba) != NULL) {
+            lba++;
+            continue;
+        }
+
+        uint32_t n = 1;
+        while (lba + n < end && n < CONFIG_BCACHE_READAHEAD_MAX && hash_lookup(lba + n) == NULL) n++;
+
+        if (blk_read(lba, ra_buf, n) != 0) return -1;
+
+        for (uint32_t i = 0; i < n; i++) {
+            struct buf *b = get_free_buf();
+            if (b == NULL) return total;
+            for (int j = 0; j < BCACHE_BLOCK_SIZE; j++) b->data[j] = ra_buf[i * BCACHE_BLOCK_SIZE + j];
+            buf_fill(b, lba + i, BUF_VALID | BUF_READAHEAD, 0);
+            bcache_stats.ra_sectors++;
+            total++;
+        }
+        lba += n;
+    }
+    return total;
+}
+
+// Write a buffer the caller has changed back to its sector right away. The
+// caller still holds its reference. Returns 0 on success, -1 on a disk
+// error.
+int bwrite(struct buf *b) {
+    if (blk_write(b->lba, b->data, 1) != 0) return -1;
+    if (b->flags & BUF_DIRTY) {
+        b->flags &= ~BUF_DIRTY;
+        num_dirty--;
+    }
+    bcache_stats.writebacks++;
+    return 0;
+}
+
+// Note that the caller changed b. It's written back by a later bsync().
+void bdirty(struct buf *b) {
+    if (!(b->flags & BUF_DIRTY)) {
+        b->flags |= BUF_DIRTY;
+        num_dirty++;
+    }
+    if (num_dirty > CONFIG_BCACHE_DIRTY_MAX)
+        bsync_pressure();
+}
+
+// Number of buffers waiting to be written back
+uint32_t bcache_dirty(void) {
+    return num_dirty;
+}
+
+// Have fn run before every write back the cache does by itself under
+// pressure, so a filesystem can get its own metadata (the FAT) out first.
+// Returns 0 on success; anything else holds the write back off.
+void bcache_set_presync(int (*fn)(void)) {
+    presync = fn;
+}
+
+// Write back every dirty buffer covering [lba, lba + count). They go to
+// the block queue as one batch, which puts them in LBA order so the disk
+// sees one sweep, and turns runs of neighbouring sectors into single
+// commands. Returns 0, or -1 if any write failed (those buffers stay
+// dirty).
+int bsync_range(uint32_t lba, uint32_t count) {
+    static struct buf *batch[CONFIG_BCACHE_SIZE];
+    static struct blk_request reqs[CONFIG_BCACHE_SIZE];
+    int n = 0;
+    int r = 0;
+
+    if (num_dirty == 0) return 0;
+
+    blk_plug();
+    for (int i = 0; i < CONFIG_BCACHE_SIZE; i++) {
+        struct buf *b = &bufs[i];
+        if (!(b->flags & BUF_DIRTY) || b->lba - lba >= count) continue;
+        reqs[n] = (struct blk_request){
+            .lba = b->lba,
+            .buffer = b->data,
+            .count = 1,
+            .write = 1,
+            .done = NULL,
+        };
+        if (blk_submit(&reqs[n]) != 0) {
+            r = -1;
+            continue;
+        }
+        batch[n++] = b;
+    }
+    blk_unplug();
+
+    for (int i = 0; i < n; i++) {
+        if (blk_wait(&reqs[i]) != 0) {
+            r = -1;
+            continue;
+        }
+        batch[i]->flags &= ~BUF_DIRTY;
+        num_dirty--;
+        bcache_stats.writebacks++;
+    }
+    return r;
+}
+
+int bsync(void) {
+    if (num_dirty == 0) return 0;
+    bcache_stats.syncs++;
+    return bsync_range(0, 0xFFFFFFFF);
+}
+
+void brelse(struct buf *b) {
+    if (b != NULL && b->refcount > 0) b->refcount--;
+}
+
+// Forget any cached copies of count sectors from lba, for when data has
+// been written to them around the cache. Dirty copies are dropped too, the
+// new data replaces them. A buffer someone still holds can't just vanish
+// under them, so it's kept and gets a clean copy of the new data instead.
+void bcache_invalidate(uint32_t lba, const uint8_t *data, uint32_t count) {
+    for (int i = 0; i < CONFIG_BCACHE_SIZE; i++) {
+        struct buf *b = &bufs[i];
+        if (!(b->flags & BUF_VALID) || b->lba - lba >= count)
+            continue;
+
+        if (b->flags & BUF_DIRTY) num_dirty--;
+        if (b->flags & BUF_READAHEAD) bcache_stats.ra_wasted++;
+        if (b->refcount > 0) {
+            const uint8_t *src = data + (b->lba - lba) * BCACHE_BLOCK_SIZE;
+            for (int j = 0; j < BCACHE_BLOCK_SIZE; j++) b->data[j] = src[j];
+            b->flags = BUF_VALID;
+            continue;
+        }
+        hash_remove(b);
+        b->flags = 0;
+    }
+}
@@ -0,0 +1,72 @@
+#ifndef __BCACHE_H__
+#define __BCACHE_H__
+
+#include <stdint.h>
+
+#ifndef CONFIG_BCACHE_SIZE
+#define CONFIG_BCACHE_SIZE 64   // Number of sector buffers in the cache
+#endif
+
+#define BCACHE_BLOCK_SIZE 512
+#define BCACHE_HASH_SIZE 64
+
+// buf flags
+#define BUF_VALID 0x1   // data holds what's on disk at lba
+#define BUF_DIRTY 0x2   // data is newer than what's on disk
+#define BUF_READAHEAD 0x4   // filled by breadahead() and not asked for since
+
+#ifndef CONFIG_BCACHE_DIRTY_MAX
+#define CONFIG_BCACHE_DIRTY_MAX (CONFIG_BCACHE_SIZE / 2)  // Write back once this many are dirty
+#endif
+
+#ifndef CONFIG_BCACHE_READAHEAD_MAX
+#define CONFIG_BCACHE_READAHEAD_MAX (CONFIG_BCACHE_SIZE / 4)  // Sectors per readahead command
+#endif
+
+/*
+ * One cached disk sector. Buffers are found by LBA through a hash table and
+ * kept on an LRU list; only buffers nobody holds (refcount 0) get recycled.
+ * Changes are written back later: dirty buffers go to disk in LBA order on
+ * bsync(), or when too many of them pile up.
+ *
+ */
+struct buf {
+    struct buf *hash_next;
+    struct buf *lru_next;   // Towards least recently used
+    struct buf *lru_prev;   // Towards most recently used
+    uint32_t lba;
+    uint32_t flags;
+    uint32_t refcount;
+    uint8_t *data;
+};
+
+struct bcache_stats {
+    uint32_t hits;
+    uint32_t misses;
+    uint32_t evictions;
+    uint32_t writebacks;    // Dirty sectors written to disk
+    uint32_t syncs;         // bsync() passes that found something to write
+    uint32_t pressure;      // Syncs forced by running out of clean buffers
+    uint32_t ra_sectors;    // Sectors brought in by breadahead()
+    uint32_t ra_hits;       // ...that were asked for before being recycled
+    uint32_t ra_wasted;     // ...that were recycled or invalidated unused
+};
+
+extern struct bcache_stats bcache_stats;
+
+int bcache_init(void);
+struct buf *bread(uint32_t lba);
+struct buf *bpeek(uint32_t lba);
+struct buf *bget(uint32_t lba);
+int bcached(uint32_t lba);
+int breadahead(uint32_t lba, uint32_t count);
+int bwrite(struct buf *b);
+void bdirty(struct buf *b);
+void brelse(struct buf *b);
+int bsync(void);
+int bsync_range(uint32_t lba, uint32_t count);
+void bcache_invalidate(uint32_t lba, const uint8_t *data, uint32_t count);
+uint32_t bcache_dirty(void);
+void bcache_set_presync(int (*fn)(void));
+
+#endif
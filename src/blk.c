@@ -0,0 +1,377 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "blk.h"
+#include "ide.h"
+#include "interrupt.h"
+
+struct blk_stats blk_stats;
+
+// Waiting requests, lowest LBA first. Only touched with interrupts off,
+// the IRQ14 handler starts the next command when one finishes.
+static struct blk_request *queue;
+
+// The requests riding on the command the drive is working on, chained by
+// next, NULL when there isn't one. The drive only does one at a time.
+static struct blk_request *active;
+static struct ata_request cmd;
+static struct ata_sg sg[CONFIG_BLK_MAX_SEGMENTS];
+
+// A flush waiting for the queue to drain, and what was submitted after
+// it, in order. Nothing held goes in the queue until the flush is done.
+static struct blk_request *barrier;
+static struct blk_request *held;
+static struct blk_request **held_tail = &held;
+
+static uint32_t head;       // LBA just past the last command, where the elevator is
+static int plugged;
+static int blk_ready;
+
+// Put rq in the queue in LBA order
+static void blk_insert(struct blk_request *rq) {
+    struct blk_request **link = &queue;
+    while (*link != NULL && (*link)->lba <= rq->lba) link = &(*link)->next;
+    rq->next = *link;
+    *link = rq;
+}
+
+// The flush is done, let through what was held behind it up to the next one
+static void blk_release(void) {
+    barrier = NULL;
+    while (held != NULL) {
+        struct blk_request *rq = held;
+        held = rq->next;
+        if (rq->flush) {
+            barrier = rq;
+            break;
+        }
+        blk_insert(rq);
+    }
+    if (held == NULL)
+        held_tail = &held;
+}
+
+// Hand the requests of the command that just finished back with status
+static void blk_finish(int status) {
+    struct blk_request *r = active;
+
+    active = NULL;
+    while (r != NULL) {
+        struct blk_request *next = r->next;
+        uint32_t latency = pit_ticks - r->queued;
+        blk_stats.completed++;
+        blk_stats.latency_total += latency;
+        if (latency > blk_stats.latency_max) blk_stats.latency_max = latency;
+        blk_stats.depth--;
+
+        if (r == barrier)
+            blk_release();
+
+        // The waiter may reuse r as soon as it sees the status
+        r->status = status;
+        if (r->done != NULL)
+            r->done(r);
+        r = next;
+    }
+}
+
+// IRQ14 finished our command. The next one is started by blk_dispatch()
+// as the drive's idle hook.
+static void blk_done(struct ata_request *rq) {
+    blk_finish(rq->status);
+}
+
+// Put a chain of requests that couldn't be started back in the queue
+static void blk_requeue(struct blk_request *r) {
+    while (r != NULL) {
+        struct blk_request *next = r->next;
+        blk_insert(r);
+        r = next;
+    }
+}
+
+// Everything before the barrier is done, send its FLUSH CACHE. If nothing
+// was written since the last one the drive isn't bothered. Returns
+// ATA_BUSY if the drive is on someone else's transfer, 0 otherwise.
+static int blk_start_flush(void) {
+    int r = 0;
+
+    active = barrier;
+    active->next = NULL;
+    if (ata_flush_pending()) {
+        cmd = (struct ata_request){
+            .flush = 1,
+            .done = blk_done,
+        };
+        r = ata_submit(&cmd);
+        if (r == ATA_BUSY) {
+            active = NULL;
+            return ATA_BUSY;
+        }
+        blk_stats.commands++;
+        if (r == 0)
+            return 0;
+    }
+    blk_finish(r);
+    return 0;
+}
+
+// Which queued request goes next. Returns the link pointing at it.
+static struct blk_request **blk_pick(void) {
+    struct blk_request **link, **oldest = &queue, **up = NULL;
+
+    for (link = &queue; *link != NULL; link = &(*link)->next) {
+        if ((*link)->queued - (*oldest)->queued >= 0x80000000)
+            oldest = link;      // Queued earlier, allowing for wrap
+        if (up == NULL && (*link)->lba >= head)
+            up = link;
+    }
+    if (up == NULL)
+        up = &queue;        // Back round to the bottom
+    if (pit_ticks - (*oldest)->queued >= CONFIG_BLK_DEADLINE_TICKS && oldest != up) {
+        blk_stats.expired++;
+        return oldest;
+    }
+    return up;
+}
+
+// Start the next command if the drive is free, taking along whatever
+// carries straight on from it, or the barrier once the queue is empty.
+// Interrupts must be off. If the drive turns out to be busy with someone
+// else's transfer the requests stay queued, and this runs again from the
+// idle hook when it's done.
+static void blk_dispatch(void) {
+    while (active == NULL && !plugged) {
+        if (queue == NULL) {
+            if (barrier == NULL || blk_start_flush() == ATA_BUSY)
+                return;
+            continue;
+        }
+
+        struct blk_request **link = blk_pick();
+        struct blk_request *first = *link;
+        struct blk_request *last = first;
+        uint32_t count = first->count;
+        uint32_t n = 1;
+        int r;
+
+        *link = first->next;
+        sg[0].buffer = first->buffer;
+        sg[0].count = first->count;
+
+        // The queue is sorted, so anything that continues this is next
+        while (first->frames == NULL && *link != NULL && n < CONFIG_BLK_MAX_SEGMENTS) {
+            struct blk_request *r = *link;
+            if (r->frames != NULL || r->write != first->write || r->lba != first->lba + count ||
+                count + r->count > ata_drive.max_sectors)
+                break;
+            *link = r->next;
+            last->next = r;
+            last = r;
+            sg[n].buffer = r->buffer;
+            sg[n].count = r->count;
+            count += r->count;
+            n++;
+        }
+        last->next = NULL;
+
+        active = first;
+        head = first->lba + count;
+        cmd = (struct ata_request){
+            .lba = first->lba,
+            .frames = first->frames,
+            .sg = first->frames == NULL ? sg : NULL,
+            .nsg = n,
+            .count = count,
+            .write = first->write,
+            .done = blk_done,
+        };
+        r = ata_submit(&cmd);
+        if (r == ATA_BUSY) {
+            active = NULL;
+            blk_requeue(first);
+            return;
+        }
+        blk_stats.commands++;
+        blk_stats.merges += n - 1;
+        if (r != 0)
+            blk_finish(-1);     // And carry on with the rest of the queue
+    }
+}
+
+// Start feeding the drive from the queue. Call after ata_init(); until
+// then requests go straight to the drive.
+void blk_init(void) {
+    queue = NULL;
+    active = NULL;
+    barrier = NULL;
+    held = NULL;
+    held_tail = &held;
+    plugged = 0;
+    head = 0;
+    ata_set_idle_hook(blk_dispatch);
+    blk_ready = 1;
+}
+
+// Queue rq and return without waiting for it. Before blk_init() it's done
+// there and then by polling. Returns 0, or -1 if rq is empty or too big
+// for one command.
+int blk_submit(struct blk_request *rq) {
+    if (!rq->flush && (rq->count == 0 || rq->count > ata_drive.max_sectors))
+        return -1;
+
+    rq->status = BLK_PENDING;
+    rq->queued = pit_ticks;
+    if (!blk_ready) {
+        if (rq->flush)
+            rq->status = ata_flush();
+        else if (rq->frames != NULL)
+            rq->status = rq->write ? ata_write_frames(rq->lba, rq->frames, rq->count) :
+                                     ata_read_frames(rq->lba, rq->frames, rq->count);
+        else if (rq->write)
+            rq->status = ata_lba_write(rq->lba, rq->buffer, rq->count);
+        else
+            rq->status = ata_lba_read(rq->lba, rq->buffer, rq->count);
+        if (rq->done != NULL)
+            rq->done(rq);
+        return 0;
+    }
+
+    uint32_t flags = irq_save();
+    if (barrier != NULL) {
+        rq->next = NULL;
+        *held_tail = rq;
+        held_tail = &rq->next;
+    } else if (rq->flush) {
+        barrier = rq;
+    } else {
+        blk_insert(rq);
+    }
+
+    blk_stats.requests++;
+    blk_stats.depth++;
+    blk_stats.depth_total += blk_stats.depth;
+    if (blk_stats.depth > blk_stats.max_depth) blk_stats.max_depth = blk_stats.depth;
+
+    blk_dispatch();
+    irq_restore(flags);
+    return 0;
+}
+
+// Halt until rq is done, the same way as ata_wait(), leaving interrupts as
+// the caller had them. Don't call it while plugged, rq might not have been
+// started. Returns rq's status.
+int blk_wait(struct blk_request *rq) {
+    uint32_t flags = irq_save();
+    while (rq->status == BLK_PENDING)
+        asm volatile("sti; hlt; cli" : : : "memory");
+    irq_restore(flags);
+    return rq->status;
+}
+
+// Hold requests in the queue until blk_unplug(), so a batch submitted in
+// between gets sorted and merged as a whole. Calls nest.
+void blk_plug(void) {
+    uint32_t flags = irq_save();
+    plugged++;
+    irq_restore(flags);
+}
+
+void blk_unplug(void) {
+    uint32_t flags = irq_save();
+    if (plugged > 0 && --plugged == 0)
+        blk_dispatch();
+    irq_restore(flags);
+}
+
+static int blk_rw(int write, uint32_t lba, uint8_t *buffer, uint32_t count) {
+    struct blk_request rq = {
+        .lba = lba,
+        .buffer = buffer,
+        .count = count,
+        .write = write,
+        .done = NULL,
+    };
+    if (blk_submit(&rq) != 0)
+        return -1;
+    return blk_wait(&rq);
+}
+
+// Read count sectors from lba into buffer through the queue, and wait for
+// them. Returns 0, or -1 on an error.
+int blk_read(uint32_t lba, uint8_t *buffer, uint32_t count) {
+    return blk_rw(0, lba, buffer, count);
+}
+
+int blk_write(uint32_t lba, uint8_t *buffer, uint32_t count) {
+    return blk_rw(1, lba, buffer, count);
+}
+
+// Move count sectors between lba and a list of PFA frames, filling each
+// frame before moving on to the next. Frames in the kernel's linear
+// mapping go as ordinary requests, so neighbouring ones share a command
+// whether or not there's DMA. Any others need the controller to scatter
+// into them. Returns 0, or -1 on an error.
+static int blk_frames(int write, uint32_t lba, struct ppage *frames, uint32_t count) {
+    static struct blk_request reqs[CONFIG_BLK_MAX_SEGMENTS];
+    const uint32_t per_frame = PAGE_SIZE / 512;
+    struct ppage *p = frames;
+    int r = 0;
+
+    while (count > 0 && r == 0) {
+        uint32_t n = 0;
+
+        blk_plug();
+        while (count > 0 && n < CONFIG_BLK_MAX_SEGMENTS) {
+            if (p == NULL) {
+                r = -1;
+                break;
+            }
+            uint32_t len = count < per_frame ? count : per_frame;
+            reqs[n] = (struct blk_request){
+                .lba = lba,
+                .count = len,
+                .write = write,
+                .done = NULL,
+            };
+            if ((uintptr_t)p->physical_addr + PAGE_SIZE <= KERNEL_LOWMEM_LIMIT)
+                reqs[n].buffer = P2V(p->physical_addr);
+            else
+                reqs[n].frames = p;
+            if (blk_submit(&reqs[n]) != 0) {
+                r = -1;
+                break;
+            }
+            n++;
+            lba += len;
+            count -= len;
+            p = p->next;
+        }
+        blk_unplug();
+
+        for (uint32_t i = 0; i < n; i++)
+            if (blk_wait(&reqs[i]) != 0)
+                r = -1;
+    }
+    return r;
+}
+
+int blk_read_frames(uint32_t lba, struct ppage *frames, uint32_t count) {
+    return blk_frames(0, lba, frames, count);
+}
+
+int blk_write_frames(uint32_t lba, struct ppage *frames, uint32_t count) {
+    return blk_frames(1, lba, frames, count);
+}
+
+// Have the drive write its cache out once everything submitted so far is
+// done, and wait for it. Requests submitted in the meantime wait behind
+// it. Returns 0, or -1 on an error.
+int blk_flush(void) {
+    struct blk_request rq = {
+        .flush = 1,
+        .done = NULL,
+    };
+    if (blk_submit(&rq) != 0)
+        return -1;
+    return blk_wait(&rq);
+}
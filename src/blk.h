@@ -0,0 +1,74 @@
+#ifndef __BLK_H__
+#define __BLK_H__
+
+#include <stdint.h>
+#include "page.h"
+
+#ifndef CONFIG_BLK_MAX_SEGMENTS
+#define CONFIG_BLK_MAX_SEGMENTS 32  // Most requests merged into one command
+#endif
+
+#ifndef CONFIG_BLK_DEADLINE_TICKS
+#define CONFIG_BLK_DEADLINE_TICKS 50   // A request queued this long goes next, whatever the elevator says
+#endif
+
+#define BLK_PENDING 1   // blk_request status until it's done
+
+/*
+ * A block I/O request. Requests wait in one queue sorted by LBA and the
+ * drive is fed from it in elevator order: upwards from where the last
+ * command left off, then back round to the lowest LBA. A request that has
+ * waited CONFIG_BLK_DEADLINE_TICKS jumps the queue. Requests in the same
+ * direction that carry straight on from each other go to the drive as one
+ * command. When a request is done its status is 0, or -1 if the command it
+ * was part of failed, and done is called (in interrupt context) if set.
+ *
+ * Requests for overlapping sectors can be reordered, so wait for one
+ * before submitting the other.
+ *
+ * A flush request is a barrier: it waits for everything submitted before
+ * it, then the drive's write cache is flushed, and only then does anything
+ * submitted after it go to the drive. A request with frames goes to the
+ * drive on its own command, scattered into the frames by DMA.
+ *
+ */
+struct blk_request {
+    struct blk_request *next;   // In the queue, or in the same command
+    uint32_t lba;
+    uint8_t *buffer;
+    struct ppage *frames;       // If not NULL, move the data here instead of buffer
+    uint32_t count;             // Sectors, at most ata_drive.max_sectors
+    int write;
+    int flush;                  // FLUSH CACHE barrier, lba, buffer and count are ignored
+    volatile int status;
+    uint32_t queued;            // pit_ticks when submitted
+    void (*done)(struct blk_request *rq);
+};
+
+struct blk_stats {
+    uint32_t requests;
+    uint32_t commands;      // Sent to the drive
+    uint32_t merges;        // Requests that went along with another's command
+    uint32_t expired;       // Commands started out of elevator order for a deadline
+    uint32_t depth;         // Requests queued or in flight right now
+    uint32_t max_depth;
+    uint32_t depth_total;   // Sum of the depth each request found, for the average
+    uint32_t completed;
+    uint32_t latency_total; // Ticks from submission to completion, summed
+    uint32_t latency_max;
+};
+
+extern struct blk_stats blk_stats;
+
+void blk_init(void);
+int blk_submit(struct blk_request *rq);
+int blk_wait(struct blk_request *rq);
+void blk_plug(void);
+void blk_unplug(void);
+int blk_read(uint32_t lba, uint8_t *buffer, uint32_t count);
+int blk_write(uint32_t lba, uint8_t *buffer, uint32_t count);
+int blk_read_frames(uint32_t lba, struct ppage *frames, uint32_t count);
+int blk_write_frames(uint32_t lba, struct ppage *frames, uint32_t count);
+int blk_flush(void);
+
+#endif
@@ -0,0 +1,116 @@
+
+;=============================================================================
+; Early boot stub
+;
+; GRUB jumps here with paging off, so unlike the rest of the kernel this code
+; is linked at the physical address it is loaded at. It builds a temporary
+; page directory that maps
+;
+;   0 - 4 MiB           -> 0 - 4 MiB  (so we survive turning paging on)
+;   0xC0000000 - 1020 MiB -> 0 - 1020 MiB
+;
+; with 4 MiB pages, turns paging on, switches to the kernel stack and jumps
+; to main() in the higher half. main() builds the real page directory and
+; drops the low identity mapping.
+;
+; A CPU without 4 MiB pages (no PSE, or no CPUID to ask) can't run this, so
+; the stub says so on the screen and halts.
+;
+; EAX (Multiboot2 magic) and EBX (info pointer) are passed to
+; main(magic, mb_info) as cdecl arguments.
+;
+;=============================================================================
+
+KERNEL_VIRT_BASE equ 0xC0000000
+KERNEL_PDE       equ KERNEL_VIRT_BASE >> 22
+LOWMEM_PDES      equ 255              ; Stop short of the page table window
+PDE_LARGE        equ 0x83             ; Present | R/W | 4 MiB page
+STACK_SIZE       equ 16384
+EFLAGS_ID        equ 0x200000         ; Only writable if the CPU has CPUID
+CPUID_PSE        equ 1 << 3           ; CPUID.01h:EDX
+VGA_TEXT         equ 0xB8000
+
+    [BITS 32]
+    section .boot progbits alloc exec write align=4096
+    global _boot
+    extern main
+
+boot_pd:
+    times 1024 dd 0
+
+_boot:
+    mov esi, eax                      ; Save the magic
+    mov edi, ebx                      ; ...and the info pointer, CPUID uses EBX
+    mov esp, stack_top - KERNEL_VIRT_BASE   ; GRUB doesn't give us a stack
+
+    pushfd                            ; Does EFLAGS.ID stick?
+    pop eax
+    mov ecx, eax
+    xor eax, EFLAGS_ID
+    push eax
+    popfd
+    pushfd
+    pop eax
+    push ecx                          ; Put EFLAGS back as it was
+    popfd
+    xor eax, ecx
+    jz .no_pse
+
+    mov eax, 1
+    cpuid
+    test edx, CPUID_PSE
+    jz .no_pse
+    mov ebx, edi
+
+    mov dword [boot_pd], PDE_LARGE    ; Identity map the first 4 MiB
+
+    xor ecx, ecx
+    mov edx, PDE_LARGE
+.map_lowmem:
+    mov [boot_pd + KERNEL_PDE * 4 + ecx * 4], edx
+    add edx, 0x400000
+    inc ecx
+    cmp ecx, LOWMEM_PDES
+    jne .map_lowmem
+
+    mov eax, cr4                      ; Enable 4 MiB pages
+    or eax, 0x10
+    mov cr4, eax
+
+    mov eax, boot_pd
+    mov cr3, eax
+
+    mov eax, cr0                      ; Enable paging
+    or eax, 0x80000001
+    mov cr0, eax
+
+    mov esp, stack_top
+    push ebx                          ; main(magic, mb_info)
+    push esi
+    mov ecx, main                     ; Absolute call into the higher half
+    call ecx
+
+.hang:                                ; main() shouldn't return
+    cli
+    hlt
+    jmp .hang
+
+.no_pse:
+    cld
+    mov esi, no_pse_msg
+    mov edi, VGA_TEXT
+.print:
+    lodsb
+    test al, al
+    jz .hang
+    mov ah, 0x4F                      ; White on red
+    stosw
+    jmp .print
+
+no_pse_msg:
+    db "This CPU has no 4 MiB pages (PSE), the kernel can't start", 0
+
+
+    section .stack nobits alloc write align=16
+    resb STACK_SIZE
+stack_top:
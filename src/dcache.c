@@ -0,0 +1,79 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "dcache.h"
+
+static struct dentry dentries[CONFIG_DCACHE_SIZE];
+static struct dentry *hash_table[DCACHE_HASH_SIZE];
+static uint32_t next_victim;    // Entries are recycled round robin
+static uint32_t num_used;
+
+struct dcache_stats dcache_stats;
+
+static int name_eq(const char *a, const char *b) {
+    for (int i = 0; i < 11; i++) {
+        if (a[i] != b[i]) return 0;
+    }
+    return 1;
+}
+
+static uint32_t hash_name(uint32_t dir, const char *name) {
+    uint32_t h = dir * 31;
+    for (int i = 0; i < 11; i++) h = h * 31 + (uint8_t)name[i];
+    return h % DCACHE_HASH_SIZE;
+}
+
+static void hash_remove(struct dentry *d) {
+    struct dentry **link = &hash_table[hash_name(d->dir, d->name)];
+    while (*link && *link != d) link = &(*link)->hash_next;
+    if (*link) *link = d->hash_next;
+    d->hash_next = NULL;
+}
+
+// Find the cached entry for name in dir. A hit may be negative, meaning the
+// name is known not to exist. Returns NULL if we have to go to the disk.
+struct dentry *dcache_lookup(uint32_t dir, const char name[11]) {
+    for (struct dentry *d = hash_table[hash_name(dir, name)]; d != NULL; d = d->hash_next) {
+        if (d->dir == dir && name_eq(d->name, name)) {
+            if (d->negative) dcache_stats.negative_hits++;
+            else dcache_stats.hits++;
+            return d;
+        }
+    }
+    dcache_stats.misses++;
+    return NULL;
+}
+
+// Remember what a directory scan found for name in dir, and where. Pass rde
+// NULL to remember that it wasn't there. Also used to refresh an entry after
+// it's been changed on disk.
+void dcache_insert(uint32_t dir, const char name[11], const struct root_directory_entry *rde, uint32_t lba, uint32_t index) {
+    dcache_invalidate(dir, name);
+
+    struct dentry *d = &dentries[next_victim];
+    next_victim = (next_victim + 1) % CONFIG_DCACHE_SIZE;
+    if (num_used < CONFIG_DCACHE_SIZE) num_used++;
+    else hash_remove(d);
+
+    d->dir = dir;
+    for (int i = 0; i < 11; i++) d->name[i] = name[i];
+    d->negative = (rde == NULL);
+    if (rde != NULL) d->rde = *rde;
+    d->lba = lba;
+    d->index = index;
+
+    uint32_t h = hash_name(dir, name);
+    d->hash_next = hash_table[h];
+    hash_table[h] = d;
+}
+
+// Forget name in dir, for when the directory changes under us
+void dcache_invalidate(uint32_t dir, const char name[11]) {
+    for (struct dentry *d = hash_table[hash_name(dir, name)]; d != NULL; d = d->hash_next) {
+        if (d->dir == dir && name_eq(d->name, name)) {
+            hash_remove(d);
+            d->dir = 0;
+            d->name[0] = 0;
+            return;
+        }
+    }
+}
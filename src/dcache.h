@@ -0,0 +1,41 @@
+#ifndef __DCACHE_H__
+#define __DCACHE_H__
+
+#include <stdint.h>
+#include "fat.h"
+
+#ifndef CONFIG_DCACHE_SIZE
+#define CONFIG_DCACHE_SIZE 128  // Number of directory entries we remember
+#endif
+
+#define DCACHE_HASH_SIZE 64
+
+/*
+ * A cached directory lookup, keyed by the directory's first cluster (0 for
+ * the root directory) and the padded, uppercased 8.3 name exactly as it's
+ * stored on disk. Negative entries remember names that aren't there.
+ *
+ */
+struct dentry {
+    struct dentry *hash_next;
+    uint32_t dir;
+    char name[11];
+    uint8_t negative;
+    struct root_directory_entry rde;
+    uint32_t lba;       // Sector holding the entry on disk
+    uint32_t index;     // Entry number within that sector
+};
+
+struct dcache_stats {
+    uint32_t hits;
+    uint32_t negative_hits;
+    uint32_t misses;
+};
+
+extern struct dcache_stats dcache_stats;
+
+struct dentry *dcache_lookup(uint32_t dir, const char name[11]);
+void dcache_insert(uint32_t dir, const char name[11], const struct root_directory_entry *rde, uint32_t lba, uint32_t index);
+void dcache_invalidate(uint32_t dir, const char name[11]);
+
+#endif
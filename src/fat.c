@@ -1,15 +1,93 @@
 #include <stddef.h>
+#include <stdbool.h>
 #include "fat.h"
-#include "ide.h" // See this file for function prototype of ata_lba_read()
+#include "bcache.h" // Metadata and partial sectors go through the block cache
+#include "blk.h"    // Whole-sector file data is read straight into the caller's buffer
+#include "ide.h"
+#include "kmalloc.h"
+#include "dcache.h"
+#include "page.h"     // FAT cache pages come straight from the PFA
 
 #define SECTOR_SIZE 512
 
+// fatFragReport() doesn't follow directories deeper than this
+#define FAT_MAX_DEPTH 16
+
+// Small writes to a new or blocked file look for at least this many free
+// clusters in a row, so it has somewhere to grow into
+#define FAT_ALLOC_GOAL_RUN 64
+
 struct boot_sector *bs;
 char bootSector[512]; // Allocate a global array to store boot sector
-char fat_table[8*SECTOR_SIZE];
 unsigned int root_sector;
+uint32_t root_dir_sectors;
+uint32_t data_sector;  // LBA of cluster 2
+uint32_t fat_type;
+static uint32_t root_cluster;          // FAT32 root directory, 0 on FAT16 where it has fixed sectors
+static uint32_t fat_sectors;           // Sectors per FAT
+static uint32_t fat_entry_size;        // Bytes per FAT entry, 2 or 4
+
+// The FAT is cached a page at a time, in at most CONFIG_FAT_CACHE_PAGES
+// frames. fat_resident[i] is the slot holding FAT sectors
+// i * fat_sectors_per_page and up, or NULL if they aren't in memory.
+struct fat_page {
+    uint32_t page;                     // Which page of the FAT, if frame is set
+    struct ppage *frame;
+    uint32_t last_used;                // fat_cache_clock when it was last looked at
+};
+static struct fat_page fat_pages[CONFIG_FAT_CACHE_PAGES];
+static struct fat_page **fat_resident;
+static uint32_t fat_cache_clock;
+static uint32_t *fat_dirty;            // One bit per FAT sector, set by fat_set_entry()
+static uint32_t fat_num_dirty;
+static uint32_t last_writeback;        // Tick count of the last fatWriteback() flush
+static uint32_t fat_lba;               // First sector of the first FAT
+static uint32_t fat_sectors_per_page;
+static uint32_t fat_num_entries;       // Valid cluster numbers are below this
+
+// Free cluster bitmap, a set bit means in use. Built from the FAT at mount
+// and kept in step with it.
+static uint32_t *cluster_map;
+static uint32_t alloc_hint;            // Where the next search for free space starts
+uint32_t fat_free_clusters;
+
+// FAT32 FSInfo sector, 0 if there isn't a valid one, and the free count it
+// last held
+static uint32_t fsinfo_lba;
+static uint32_t fsinfo_free;
+
+// Open file table. Handles come out of a fixed pool; free ones are chained
+// through next, open ones are on a doubly linked list.
+static struct file file_pool[CONFIG_FAT_MAX_OPEN];
+static struct file *free_files;
+struct file *open_files;
+static int file_pool_ready;
+
+// Readahead windows never grow past this, see fatInit()
+static uint32_t ra_max_clusters;
+
+// Set once fatInit() has got all the way through
+static int fat_mounted;
+
+// Copy n bytes, we don't have a libc memcpy
+static void copy_bytes(void *dst, const void *src, uint32_t n) {
+    uint8_t *d = dst;
+    const uint8_t *s = src;
+    while (n--) *d++ = *s++;
+}
+
+// Read count consecutive sectors starting at lba through the block cache
+static int read_sectors(uint32_t lba, void *dst, uint32_t count) {
+    for (uint32_t i = 0; i < count; i++) {
+        struct buf *b = bread(lba + i);
+        if (b == NULL) return -1;
+        copy_bytes((uint8_t *)dst + i * SECTOR_SIZE, b->data, SECTOR_SIZE);
+        brelse(b);
+    }
+    return 0;
+}
 
-int findLen(char *s) {
+int findLen(const char *s) {
     int l = 0;
 
     while (s[l] && s[l] != ' ') l++;
@@ -18,7 +96,7 @@ int findLen(char *s) {
 }
 
 // Returns true is they're the same, otherwise false
-int stringCompare(char str1[], char str2[]) {
+int stringCompare(const char str1[], const char str2[]) {
     int str1Size = findLen(str1);
     int str2Size = findLen(str2);
 
@@ -32,8 +110,352 @@ int stringCompare(char str1[], char str2[]) {
     return true;
 }
 
+static int fat_cache_flush(void);
+
+static inline int fat_sector_dirty(uint32_t s) {
+    return fat_dirty[s / 32] & (1u << (s % 32));
+}
+
+// Whether any sector in page of the FAT is waiting to be written
+static int fat_page_dirty(uint32_t page) {
+    for (uint32_t s = page * fat_sectors_per_page; s < (page + 1) * fat_sectors_per_page && s < fat_sectors; s++) {
+        if (fat_sector_dirty(s))
+            return 1;
+    }
+    return 0;
+}
+
+// Read page of the FAT into frame
+static int fat_page_read(uint32_t page, struct ppage *frame) {
+    uint32_t first = page * fat_sectors_per_page;
+    uint32_t count = fat_sectors - first;
+    if (count > fat_sectors_per_page) count = fat_sectors_per_page;
+    return blk_read_frames(fat_lba + first, frame, count);
+}
+
+// Find a slot for another page of the FAT: an empty one, or else the least
+// recently used. A dirty page is written out with the rest of the FAT
+// before its frame is reused. Returns NULL if there's no slot we can free.
+static struct fat_page *fat_cache_evict(void) {
+    struct fat_page *victim = NULL;
+    for (int i = 0; i < CONFIG_FAT_CACHE_PAGES; i++) {
+        struct fat_page *p = &fat_pages[i];
+        if (p->frame == NULL)
+            return p;
+        if (victim == NULL || fat_cache_clock - p->last_used > fat_cache_clock - victim->last_used)
+            victim = p;
+    }
+
+    if (fat_page_dirty(victim->page) && fat_cache_flush() != 0)
+        return NULL;
+    fat_resident[victim->page] = NULL;
+    return victim;
+}
+
+// Get the cached copy of the FAT sector holding byte offset off, loading
+// the page around it if it isn't in memory. The pointer is only good until
+// the next lookup, which may evict its page. Returns NULL if we can't.
+static uint8_t *fat_cache_lookup(uint32_t off) {
+    uint32_t sector = off / bs->bytes_per_sector;
+    uint32_t page = sector / fat_sectors_per_page;
+    struct fat_page *p = fat_resident[page];
+
+    if (p == NULL) {
+        p = fat_cache_evict();
+        if (p == NULL)
+            return NULL;
+        if (p->frame == NULL) {
+            p->frame = allocate_physical_pages(1);
+            if (p->frame == NULL)
+                return NULL;
+        }
+        if (fat_page_read(page, p->frame) != 0) {
+            free_physical_pages(p->frame);
+            p->frame = NULL;
+            return NULL;
+        }
+        p->page = page;
+        fat_resident[page] = p;
+    }
+    p->last_used = ++fat_cache_clock;
+    return (uint8_t *)P2V(p->frame->physical_addr) + (off - page * fat_sectors_per_page * bs->bytes_per_sector);
+}
+
+// Decode the FAT entry at e. FAT16 end of chain markers come back as their
+// FAT32 equivalents.
+static inline uint32_t fat_decode(const uint8_t *e) {
+    if (fat_type == 32)
+        return *(const uint32_t *)e & 0x0FFFFFFF;  // The top 4 bits are reserved
+    uint32_t v = *(const uint16_t *)e;
+    return (v >= 0xFFF7) ? v | 0x0FFF0000 : v;
+}
+
+// Next cluster in the chain after cluster. Callers only ever compare
+// against FAT_EOC, for FAT16 too. Anything out of range, or that we can't
+// read, ends the chain.
+uint32_t fat_entry(uint32_t cluster) {
+    if (cluster >= fat_num_entries)
+        return FAT_EOC_MARK;
+
+    uint8_t *e = fat_cache_lookup(cluster * fat_entry_size);
+    if (e == NULL)
+        return FAT_EOC_MARK;
+    return fat_decode(e);
+}
+
+// Change a FAT entry in the cache and remember its sector needs writing
+int fat_set_entry(uint32_t cluster, uint32_t value) {
+    if (cluster >= fat_num_entries)
+        return -1;
+
+    uint8_t *e = fat_cache_lookup(cluster * fat_entry_size);
+    if (e == NULL)
+        return -1;
+    if (fat_type == 32)
+        *(uint32_t *)e = (*(uint32_t *)e & 0xF0000000) | (value & 0x0FFFFFFF);
+    else
+        *(uint16_t *)e = value;
+
+    uint32_t sector = cluster * fat_entry_size / bs->bytes_per_sector;
+    if (!(fat_dirty[sector / 32] & (1u << (sector % 32)))) {
+        fat_dirty[sector / 32] |= 1u << (sector % 32);
+        fat_num_dirty++;
+    }
+    return 0;
+}
+
+// Size the FAT cache from the boot sector. Nothing is read yet.
+static int fat_cache_init(void) {
+    fat_lba = 2048 + bs->num_reserved_sectors;
+    fat_sectors_per_page = PAGE_SIZE / bs->bytes_per_sector;
+
+    uint32_t pages = (fat_sectors + fat_sectors_per_page - 1) / fat_sectors_per_page;
+    uint32_t words = (fat_sectors + 31) / 32;
+    fat_resident = kmalloc(pages * sizeof(struct fat_page *));
+    fat_dirty = kmalloc(words * sizeof(uint32_t));
+    if (fat_resident == NULL || fat_dirty == NULL)
+        return -1;
+    for (uint32_t i = 0; i < pages; i++) fat_resident[i] = NULL;
+    for (uint32_t i = 0; i < words; i++) fat_dirty[i] = 0;
+    for (int i = 0; i < CONFIG_FAT_CACHE_PAGES; i++) {
+        if (fat_pages[i].frame != NULL)
+            free_physical_pages(fat_pages[i].frame);
+        fat_pages[i].frame = NULL;
+    }
+
+    // The FAT may have room for more entries than there are clusters
+    uint32_t total = bs->total_sectors ? bs->total_sectors : bs->total_sectors_in_fs;
+    fat_num_entries = (total - (data_sector - 2048)) / bs->num_sectors_per_cluster + 2;
+    if (fat_num_entries > fat_sectors * bs->bytes_per_sector / fat_entry_size)
+        fat_num_entries = fat_sectors * bs->bytes_per_sector / fat_entry_size;
+    return 0;
+}
+
+// Write every dirty FAT sector to each copy of the FAT. The copies sit one
+// after another on disk, so going copy by copy and sector by sector within
+// each is a single pass in LBA order. Runs of dirty sectors in the same
+// cache page go out as one command. Returns 0, or -1 on a disk error, in
+// which case everything stays dirty to be tried again.
+static int fat_cache_flush(void) {
+    if (fat_num_dirty == 0)
+        return 0;
+
+    for (uint32_t copy = 0; copy < bs->num_fat_tables; copy++) {
+        uint32_t s = 0;
+        while (s < fat_sectors) {
+            if (!fat_sector_dirty(s)) {
+                s++;
+                continue;
+            }
+
+            uint32_t end = s + 1;
+            while (end < fat_sectors && end % fat_sectors_per_page != 0 && fat_sector_dirty(end))
+                end++;
+
+            uint8_t *data = fat_cache_lookup(s * bs->bytes_per_sector);
+            if (data == NULL)
+                return -1;
+            if (blk_write(fat_lba + copy * fat_sectors + s, data, end - s) != 0)
+                return -1;
+            s = end;
+        }
+    }
+
+    uint32_t words = (fat_sectors + 31) / 32;
+    for (uint32_t i = 0; i < words; i++) fat_dirty[i] = 0;
+    fat_num_dirty = 0;
+    return 0;
+}
+
+static inline int cluster_in_use(uint32_t c) {
+    return cluster_map[c / 32] & (1u << (c % 32));
+}
+
+static inline void mark_cluster(uint32_t c, int used) {
+    if (used) cluster_map[c / 32] |= 1u << (c % 32);
+    else cluster_map[c / 32] &= ~(1u << (c % 32));
+}
+
+// Build the free cluster bitmap from the FAT. This reads the whole FAT
+// once, after which allocation never has to look at it. The FAT streams
+// through one borrowed frame a page at a time rather than the FAT cache,
+// which would only end up holding its last few pages.
+static int cluster_map_init(void) {
+    uint32_t words = (fat_num_entries + 31) / 32;
+    cluster_map = kmalloc(words * sizeof(uint32_t));
+    if (cluster_map == NULL)
+        return -1;
+
+    struct ppage *frame = allocate_physical_pages(1);
+    if (frame == NULL)
+        return -1;
+    uint8_t *data = P2V(frame->physical_addr);
+    uint32_t per_page = fat_sectors_per_page * bs->bytes_per_sector / fat_entry_size;
+
+    // Bits past the last cluster stay set so they're never handed out
+    for (uint32_t i = 0; i < words; i++) cluster_map[i] = 0xFFFFFFFF;
+
+    fat_free_clusters = 0;
+    for (uint32_t c = 2; c < fat_num_entries; c++) {
+        if (c == 2 || c % per_page == 0) {
+            if (fat_page_read(c / per_page, frame) != 0) {
+                free_physical_pages(frame);
+                return -1;
+            }
+        }
+        if (fat_decode(data + (c % per_page) * fat_entry_size) == 0) {
+            mark_cluster(c, 0);
+            fat_free_clusters++;
+        }
+    }
+    free_physical_pages(frame);
+    alloc_hint = 2;
+    return 0;
+}
+
+// Length of the run of free clusters at c, up to limit
+static uint32_t free_run_length(uint32_t c, uint32_t limit) {
+    uint32_t n = 0;
+    while (n < limit && c + n < fat_num_entries && !cluster_in_use(c + n)) n++;
+    return n;
+}
+
+// Look in [from, to) for a free run of want clusters. Returns its start, or
+// 0 if there isn't one, keeping track of the longest run seen in *best.
+static uint32_t find_free_run(uint32_t from, uint32_t to, uint32_t want, uint32_t *best, uint32_t *best_len) {
+    uint32_t c = from;
+    while (c < to) {
+        // Skip fully used words 32 clusters at a time
+        if (c % 32 == 0 && cluster_map[c / 32] == 0xFFFFFFFF) {
+            c += 32;
+            continue;
+        }
+        if (cluster_in_use(c)) {
+            c++;
+            continue;
+        }
+
+        uint32_t len = free_run_length(c, want);
+        if (len == want)
+            return c;
+        if (len > *best_len) {
+            *best = c;
+            *best_len = len;
+        }
+        c += len;
+    }
+    return 0;
+}
+
+// Allocate up to want clusters in a row and mark them used. goal is where
+// we'd like them to start, normally right after the file's last cluster so
+// it stays contiguous. Otherwise we look for a free run with room for the
+// file to keep growing, at least FAT_ALLOC_GOAL_RUN clusters, and settle
+// for the longest one we saw. Returns the first cluster and sets *got, or
+// returns 0 if the volume is full. The FAT isn't touched.
+static uint32_t alloc_run(uint32_t goal, uint32_t want, uint32_t *got) {
+    uint32_t start = 0;
+    uint32_t search = (want < FAT_ALLOC_GOAL_RUN) ? FAT_ALLOC_GOAL_RUN : want;
+
+    if (fat_free_clusters == 0)
+        return 0;
+
+    if (goal >= 2 && goal < fat_num_entries && !cluster_in_use(goal)) {
+        start = goal;
+    } else {
+        uint32_t best = 0, best_len = 0;
+        start = find_free_run(alloc_hint, fat_num_entries, search, &best, &best_len);
+        if (start == 0)
+            start = find_free_run(2, alloc_hint, search, &best, &best_len);
+        if (start == 0)
+            start = best;
+    }
+
+    uint32_t len = free_run_length(start, want);
+    for (uint32_t i = 0; i < len; i++) mark_cluster(start + i, 1);
+    fat_free_clusters -= len;
+    alloc_hint = start + len;
+    *got = len;
+    return start;
+}
+
+// Find the FAT32 FSInfo sector and start allocating where it says the free
+// space is. Its free count is only a hint, we've just counted for real in
+// the bitmap. If the two disagree (and the count isn't just unknown) the
+// volume wasn't unmounted cleanly and next_free is no better, so the search
+// starts from the bottom. Either way fsinfo_sync() writes the real count
+// back.
+static void fsinfo_init(void) {
+    fsinfo_lba = 0;
+    if (fat_type != 32 || bs->fsinfo_sector == 0 || bs->fsinfo_sector == 0xFFFF)
+        return;
+
+    struct buf *b = bread(2048 + bs->fsinfo_sector);
+    if (b == NULL)
+        return;
+    struct fsinfo *fi = (struct fsinfo *)b->data;
+    if (fi->lead_signature == FSINFO_LEAD_SIG && fi->struct_signature == FSINFO_STRUCT_SIG &&
+        fi->trail_signature == FSINFO_TRAIL_SIG) {
+        fsinfo_lba = 2048 + bs->fsinfo_sector;
+        fsinfo_free = fi->free_count;
+        int trusted = (fi->free_count == fat_free_clusters || fi->free_count == FSINFO_UNKNOWN);
+        if (trusted && fi->next_free >= 2 && fi->next_free < fat_num_entries)
+            alloc_hint = fi->next_free;
+    }
+    brelse(b);
+}
+
+// Bring the FSInfo hints up to date in the block cache, if they changed
+static int fsinfo_sync(void) {
+    if (fsinfo_lba == 0 || fsinfo_free == fat_free_clusters)
+        return 0;
+
+    struct buf *b = bread(fsinfo_lba);
+    if (b == NULL)
+        return -1;
+    struct fsinfo *fi = (struct fsinfo *)b->data;
+    fi->free_count = fat_free_clusters;
+    fi->next_free = alloc_hint;
+    bdirty(b);
+    brelse(b);
+    fsinfo_free = fat_free_clusters;
+    return 0;
+}
+
+// Free every cluster in the chain starting at cluster
+static void free_chain(uint32_t cluster) {
+    while (cluster >= 2 && cluster < FAT_EOC && cluster < fat_num_entries) {
+        uint32_t next = fat_entry(cluster);
+        fat_set_entry(cluster, 0);
+        mark_cluster(cluster, 0);
+        fat_free_clusters++;
+        cluster = next;
+    }
+}
+
 int fatInit() {
-    if (ata_lba_read(2048, bootSector, 1) != 0){ // Read sector 0 from disk drive into bootSector array
+    fat_mounted = 0;
+    if (read_sectors(2048, bootSector, 1) != 0){ // Read sector 0 from disk drive into bootSector array
         return -1;
     }
     bs = (struct boot_sector *)bootSector; // Point boot_sector struct to the boot sector so we can read fields
@@ -43,23 +465,59 @@ int fatInit() {
         return -2;
     }
 
-    // Validate fs_type = "FAT16" using string comparison
-    const char CORRECT_FS_TYPE[] = "FAT16";
-    if (!stringCompare(bs->fs_type, CORRECT_FS_TYPE)) {
-        return -3;
+    // FAT32 has no 16 bit FAT size and an extended BPB of its own
+    if (bs->num_sectors_per_fat == 0) {
+        if (!stringCompare(bs->fs_type32, "FAT32")) {
+            return -3;
+        }
+        fat_type = 32;
+        fat_entry_size = 4;
+        fat_sectors = bs->num_sectors_per_fat32;
+        root_cluster = bs->root_cluster;
+    } else {
+        // Validate fs_type = "FAT16" using string comparison
+        const char CORRECT_FS_TYPE[] = "FAT16";
+        if (!stringCompare(bs->fs_type, CORRECT_FS_TYPE)) {
+            return -3;
+        }
+        fat_type = 16;
+        fat_entry_size = 2;
+        fat_sectors = bs->num_sectors_per_fat;
+        root_cluster = 0;
     }
 
-    // Read FAT table from the SD card into array fat_table
-    if (ata_lba_read(2048 + bs->num_reserved_sectors, fat_table, 8) != 0) {
+    // Compute root_sector as:
+    root_sector = 2048 + bs->num_fat_tables * fat_sectors + bs->num_reserved_sectors + bs->num_hidden_sectors;
+
+    // Calculate where data area starts. On FAT32 the root directory is in
+    // there too, so root_dir_sectors is 0.
+    root_dir_sectors = ((bs->num_root_dir_entries * 32) + (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
+    data_sector = 2048 + bs->num_reserved_sectors + (bs->num_fat_tables * fat_sectors) + root_dir_sectors;
+
+    // FAT sectors are read as they're needed
+    if (fat_cache_init() != 0) {
         return -4;
     }
-    // Compute root_sector as:
-    root_sector = 2048 + bs->num_fat_tables * bs->num_sectors_per_fat + bs->num_reserved_sectors + bs->num_hidden_sectors;
+    if (cluster_map_init() != 0) {
+        return -5;
+    }
+    fsinfo_init();
+
+    // Directory sectors the cache writes back under pressure mustn't reach
+    // the disk before the clusters they point at are allocated in the FAT
+    bcache_set_presync(fat_cache_flush);
 
+    // Keep a full readahead window under half the block cache, or it
+    // pushes out what it read before it's used
+    ra_max_clusters = (CONFIG_BCACHE_SIZE / 2) / bs->num_sectors_per_cluster;
+    if (ra_max_clusters > CONFIG_FAT_READAHEAD_MAX) ra_max_clusters = CONFIG_FAT_READAHEAD_MAX;
+    if (ra_max_clusters == 0) ra_max_clusters = 1;
+
+    fat_mounted = 1;
     return 0;
 }
 
-// helper for fatOpen
+// Turn an entry's padded 8.3 name into NAME.EXT
 void extract_filename(struct root_directory_entry *rde, char *fname) {
     int out = 0;
 
@@ -96,99 +554,1148 @@ static inline char to_upper(char c) {
     return c;
 }
 
-// Case-insensitive compare | Helper for fatOpen
-static int str_case_cmp(const char *a, const char *b) {
-    while (*a && *b) {
-        char ca = to_upper(*a);
-        char cb = to_upper(*b);
-        if (ca != cb) {
-            return (unsigned char)ca - (unsigned char)cb;
+// Turn one path component into the space padded, uppercased 8.3 name
+// FAT stores on disk. Returns how many characters of path it used, or -1
+// if the component isn't a valid 8.3 name.
+static int path_to_83(const char *path, char name[11]) {
+    int len = 0;
+    while (path[len] && path[len] != '/') len++;
+
+    for (int i = 0; i < 11; i++) name[i] = ' ';
+
+    // . and .. are stored as is
+    if ((len == 1 && path[0] == '.') || (len == 2 && path[0] == '.' && path[1] == '.')) {
+        for (int i = 0; i < len; i++) name[i] = '.';
+        return len;
+    }
+
+    int i = 0, out = 0;
+    while (i < len && path[i] != '.') {
+        if (out == 8) return -1;
+        name[out++] = to_upper(path[i++]);
+    }
+    if (out == 0) return -1;
+
+    if (i < len) {
+        i++;  // Skip the dot
+        out = 8;
+        while (i < len) {
+            if (out == 11 || path[i] == '.') return -1;
+            name[out++] = to_upper(path[i++]);
         }
-        a++; 
-        b++;
     }
-    return (unsigned char)*a - (unsigned char)*b;
+    return len;
 }
 
+static inline uint32_t cluster_to_lba(uint32_t cluster) {
+    return data_sector + (cluster - 2) * bs->num_sectors_per_cluster;
+}
 
-struct file *fatOpen(const char *filename) {
-    uint8_t buffer[SECTOR_SIZE];
-    struct root_directory_entry *entry;
+// First cluster of a directory entry. The high half only means that on
+// FAT32, FAT16 used the field for other things.
+static inline uint32_t entry_cluster(const struct root_directory_entry *rde) {
+    if (fat_type == 32)
+        return ((uint32_t)rde->cluster_high << 16) | rde->cluster;
+    return rde->cluster;
+}
+
+static inline void set_entry_cluster(struct root_directory_entry *rde, uint32_t cluster) {
+    rde->cluster = cluster & 0xFFFF;
+    if (fat_type == 32)
+        rde->cluster_high = cluster >> 16;
+}
 
-    // Compute root directory layout
-    uint32_t root_dir_sectors =
-        ((bs->num_root_dir_entries * 32) + (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
-    uint32_t root_dir_start = root_sector;
+// Walk f's cluster chain once and record each run of physically consecutive
+// clusters as an extent. Files that are too fragmented, or that we can't
+// allocate a map for, are left without one and read through the chain.
+static void build_extents(struct file *f) {
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
 
-    // Convert target filename to uppercase (FAT stores in uppercase)
-    char target[32];
-    int i = 0;
-    while (filename[i] && i < (int)sizeof(target) - 1) {
-        target[i] = to_upper(filename[i]);
-        i++;
+    f->extents = NULL;
+    f->num_extents = 0;
+    if (f->start_cluster < 2 || f->rde.file_size == 0)
+        return;
+
+    // First pass counts the runs so we allocate the map in one go
+    uint32_t count = 1;
+    for (uint32_t c = f->start_cluster, next; (next = fat_entry(c)) < FAT_EOC; c = next) {
+        if (next != c + 1)
+            count++;
+        if (count > CONFIG_FAT_MAX_EXTENTS)
+            return;
+    }
+
+    struct fat_extent *ext = kmalloc(count * sizeof(struct fat_extent));
+    if (ext == NULL)
+        return;
+
+    uint32_t n = 0;
+    uint32_t offset = 0;
+    uint32_t c = f->start_cluster;
+    while (c < FAT_EOC) {
+        if (n > 0 && c == ext[n - 1].cluster + ext[n - 1].length / cluster_bytes) {
+            ext[n - 1].length += cluster_bytes;
+        } else {
+            ext[n].offset = offset;
+            ext[n].lba = cluster_to_lba(c);
+            ext[n].length = cluster_bytes;
+            ext[n].cluster = c;
+            n++;
+        }
+        offset += cluster_bytes;
+        c = fat_entry(c);
     }
-    target[i] = '\0';
 
-    // Loop through root directory entries sector by sector
-    for (uint32_t sector = 0; sector < root_dir_sectors; sector++) {
-        ata_lba_read(root_dir_start + sector, buffer, 1);
-        entry = (struct root_directory_entry *)buffer;
+    f->extents = ext;
+    f->num_extents = n;
+}
+
+// Walks the sectors of a directory, whether it's the fixed size FAT16 root
+// directory or a chain of clusters.
+struct dir_iter {
+    uint32_t dir;       // First cluster, 0 for the FAT16 root directory
+    uint32_t cluster;   // Cluster we're in, the last one once we run off the end
+    uint32_t lba;       // First sector of that cluster (or of the root directory)
+    uint32_t sector;    // Next sector to hand out, relative to lba
+};
+
+// dir is the directory's first cluster, or 0 for the root directory
+static void dir_iter_start(struct dir_iter *it, uint32_t dir) {
+    // The FAT32 root directory is a chain like any other
+    if (dir == 0)
+        dir = root_cluster;
+    it->dir = dir;
+    it->cluster = dir;
+    it->lba = (dir == 0) ? root_sector : cluster_to_lba(dir);
+    it->sector = 0;
+}
+
+// LBA of the next sector of the directory, or 0 at the end
+static uint32_t dir_iter_next(struct dir_iter *it) {
+    uint32_t count = (it->dir == 0) ? root_dir_sectors : bs->num_sectors_per_cluster;
+
+    if (it->sector == count) {
+        // The root directory is a fixed size, subdirectories are chained
+        if (it->dir == 0)
+            return 0;
+        uint32_t next = fat_entry(it->cluster);
+        if (next < 2 || next >= FAT_EOC)
+            return 0;
+        it->cluster = next;
+        it->lba = cluster_to_lba(next);
+        it->sector = 0;
+    }
+    return it->lba + it->sector++;
+}
+
+// Scan directory dir (first cluster, 0 for the root directory) for name.
+// Returns 0 and fills in out and the entry's position if it's there, -1 if
+// it isn't, or -2 if we couldn't read the directory.
+static int dir_scan(uint32_t dir, const char name[11], struct root_directory_entry *out, uint32_t *lba, uint32_t *index) {
+    struct dir_iter it;
+    uint32_t sector;
+
+    dir_iter_start(&it, dir);
+    while ((sector = dir_iter_next(&it)) != 0) {
+        struct buf *b = bread(sector);
+        if (b == NULL)
+            return -2;
+        struct root_directory_entry *entry = (struct root_directory_entry *)b->data;
 
         for (int j = 0; j < bs->bytes_per_sector / sizeof(struct root_directory_entry); j++) {
             // Empty entry marks end
-            if (entry[j].file_name[0] == 0x00)
-                return NULL;
+            if (entry[j].file_name[0] == 0x00) {
+                brelse(b);
+                return -1;
+            }
 
-            // Skip deleted or non-file entries
-            if (entry[j].file_name[0] == 0xE5)
+            // Skip deleted entries, long name pieces and the volume label
+            if ((uint8_t)entry[j].file_name[0] == 0xE5)
                 continue;
-            if (entry[j].attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+            if (entry[j].attribute & FILE_ATTRIBUTE_VOLUME_ID)
                 continue;
 
-            // Extract full filename from entry
-            char extracted[16];
-            extract_filename(&entry[j], extracted);
+            // Name and extension are adjacent, so compare all 11 bytes
+            const char *on_disk = (const char *)&entry[j];
+            int k = 0;
+            while (k < 11 && on_disk[k] == name[k]) k++;
+            if (k == 11) {
+                *out = entry[j];
+                *lba = sector;
+                *index = j;
+                brelse(b);
+                return 0;
+            }
+        }
+        brelse(b);
+    }
+    return -1;
+}
+
+// Look name up in dir, through the dentry cache. Misses, including names
+// that aren't there, are cached so the next lookup doesn't scan again.
+static int dir_lookup(uint32_t dir, const char name[11], struct root_directory_entry *out, uint32_t *lba, uint32_t *index) {
+    struct dentry *d = dcache_lookup(dir, name);
+    if (d != NULL) {
+        if (d->negative)
+            return -1;
+        *out = d->rde;
+        *lba = d->lba;
+        *index = d->index;
+        return 0;
+    }
+
+    int r = dir_scan(dir, name, out, lba, index);
+    if (r == 0)
+        dcache_insert(dir, name, out, *lba, *index);
+    else if (r == -1)
+        dcache_insert(dir, name, NULL, 0, 0);
+    return r;
+}
+
+// Walk path, e.g. "/DIR/SUB/FILE.TXT", down to its last component. Names
+// are case insensitive, and a path without a leading / starts at the root
+// too. Sets *dir to the directory holding the last component and name to
+// its 8.3 name. Returns 0 if it exists, with its entry and position filled
+// in, -1 if it doesn't but its directory does, or -2 if the path is bad.
+static int walk_path(const char *path, uint32_t *dir, char name[11], struct root_directory_entry *rde, uint32_t *lba, uint32_t *index) {
+    *dir = 0;
+
+    while (*path == '/') path++;
+    if (*path == '\0')
+        return -2;
+
+    // Walk down one directory per component
+    while (1) {
+        int len = path_to_83(path, name);
+        if (len < 0)
+            return -2;
+        path += len;
+        while (*path == '/') path++;
+
+        int r = dir_lookup(*dir, name, rde, lba, index);
+        if (*path == '\0')
+            return (r == -2) ? -2 : r;
+        if (r != 0 || !(rde->attribute & FILE_ATTRIBUTE_SUBDIRECTORY))
+            return -2;
+        *dir = entry_cluster(rde);  // .. of a top level directory is 0, the root
+    }
+}
+
+// Take a handle from the pool, or NULL if they're all open
+static struct file *file_alloc(void) {
+    if (!file_pool_ready) {
+        for (int i = 0; i < CONFIG_FAT_MAX_OPEN; i++) {
+            file_pool[i].next = (i + 1 < CONFIG_FAT_MAX_OPEN) ? &file_pool[i + 1] : NULL;
+        }
+        free_files = &file_pool[0];
+        file_pool_ready = 1;
+    }
+
+    struct file *f = free_files;
+    if (f == NULL)
+        return NULL;
+    free_files = f->next;
+
+    f->prev = NULL;
+    f->next = open_files;
+    if (open_files) open_files->prev = f;
+    open_files = f;
+    return f;
+}
+
+static void file_free(struct file *f) {
+    if (f->prev) f->prev->next = f->next;
+    else open_files = f->next;
+    if (f->next) f->next->prev = f->prev;
+
+    f->prev = NULL;
+    f->next = free_files;
+    free_files = f;
+}
+
+// Make a new handle for a directory entry we've looked up
+static struct file *open_entry(uint32_t dir, const struct root_directory_entry *rde, uint32_t lba, uint32_t index) {
+    struct file *f = file_alloc();
+    if (f == NULL)
+        return NULL;
+    f->rde = *rde;
+    f->start_cluster = entry_cluster(rde);
+    f->refcount = 1;
+    f->offset = 0;
+    f->cur_index = 0;
+    f->cur_cluster = f->start_cluster;
+    f->dir_cluster = dir;
+    f->entry_lba = lba;
+    f->entry_index = index;
+    f->ra_next = 0;
+    f->ra_window = 0;
+    f->ra_end = 0;
+    build_extents(f);
+
+    return f;
+}
+
+// Open an existing file by path, see walk_path()
+struct file *fatOpen(const char *filename) {
+    struct root_directory_entry rde;
+    uint32_t dir, lba, index;
+    char name[11];
 
-            // Compare filenames
-            if (str_case_cmp(extracted, target) == 0) {
-                static struct file f; 
-                f.rde = entry[j];
-                f.start_cluster = entry[j].cluster;
-                f.next = NULL;
-                f.prev = NULL;
+    if (walk_path(filename, &dir, name, &rde, &lba, &index) != 0)
+        return NULL;
 
-                return &f;
+    // Only files can be opened
+    if (rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+        return NULL;
+
+    return open_entry(dir, &rde, lba, index);
+}
+
+// Share a handle, offset and all. Each fatDup needs its own fatClose.
+struct file *fatDup(struct file *f) {
+    f->refcount++;
+    return f;
+}
+
+// Drop a reference to f. The handle goes back to the pool when the last
+// one is gone. Returns 0, or -1 if f wasn't open.
+int fatClose(struct file *f) {
+    if (f == NULL || f->refcount == 0)
+        return -1;
+    if (--f->refcount > 0)
+        return 0;
+
+    if (f->extents != NULL)
+        kfree(f->extents);
+    f->extents = NULL;
+    f->num_extents = 0;
+    file_free(f);
+    return 0;
+}
+
+// Return the cluster holding the index'th cluster of f. Walks forward from
+// the cached cursor when it can, and only restarts from the first cluster
+// when seeking backwards.
+static uint32_t cluster_at(struct file *f, uint32_t index) {
+    if (index < f->cur_index) {
+        f->cur_index = 0;
+        f->cur_cluster = f->start_cluster;
+    }
+    while (f->cur_index < index && f->cur_cluster < FAT_EOC) {
+        f->cur_cluster = fat_entry(f->cur_cluster);
+        f->cur_index++;
+    }
+    return f->cur_cluster;
+}
+
+// Move the file offset. The cluster chain isn't walked until the next
+// read. Returns 0 on success, -1 if offset is past the end of the file.
+int fatSeek(struct file *f, uint32_t offset) {
+    if (offset > f->rde.file_size)
+        return -1;
+    f->offset = offset;
+    return 0;
+}
+
+// Find the extent holding offset, or NULL if the chain ends before it
+static struct fat_extent *find_extent(struct file *f, uint32_t offset) {
+    uint32_t lo = 0;
+    uint32_t hi = f->num_extents;
+
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (f->extents[mid].offset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (offset - f->extents[lo].offset >= f->extents[lo].length)
+        return NULL;
+    return &f->extents[lo];
+}
+
+// Move up to len bytes between buf and sectors contiguous sectors, starting
+// skip bytes into sector lba. Whole sectors go straight between buf and the
+// disk, as few commands as possible, except that reads take sectors the
+// cache already has (read ahead, or dirty) from there. Partial ones at
+// either end are bounced through the block cache so we never touch buf past
+// len, or the rest of a sector on disk. Partial writes are left dirty in the
+// cache. Returns the number of bytes moved, or -1 on a disk error.
+static int span_io(int write, uint32_t lba, uint32_t skip, uint32_t sectors, uint8_t *buf, uint32_t len) {
+    uint32_t done = 0;
+
+    // Leading partial sector
+    if (skip > 0) {
+        struct buf *b = bread(lba);
+        if (b == NULL)
+            return -1;
+        uint32_t n = bs->bytes_per_sector - skip;
+        if (n > len) n = len;
+        if (write) {
+            copy_bytes(b->data + skip, buf, n);
+            bdirty(b);
+        } else {
+            copy_bytes(buf, b->data + skip, n);
+        }
+        brelse(b);
+        done += n;
+        lba++;
+        sectors--;
+    }
+
+    // Whole sectors, as many per command as the drive takes
+    uint32_t whole = (len - done) / bs->bytes_per_sector;
+    if (whole > sectors) whole = sectors;
+    while (whole > 0) {
+        uint32_t count = whole > ata_drive.max_sectors ? ata_drive.max_sectors : whole;
+        if (write) {
+            if (blk_write(lba, buf + done, count) != 0)
+                return -1;
+            bcache_invalidate(lba, buf + done, count);
+        } else {
+            struct buf *b = bpeek(lba);
+            if (b != NULL) {
+                copy_bytes(buf + done, b->data, bs->bytes_per_sector);
+                brelse(b);
+                count = 1;
+            } else {
+                // Read up to the next sector the cache has
+                uint32_t n = 1;
+                while (n < count && !bcached(lba + n)) n++;
+                count = n;
+                if (blk_read(lba, buf + done, count) != 0)
+                    return -1;
             }
         }
+        done += count * bs->bytes_per_sector;
+        lba += count;
+        sectors -= count;
+        whole -= count;
+    }
+
+    // Trailing partial sector
+    if (sectors > 0 && done < len) {
+        struct buf *b = bread(lba);
+        if (b == NULL)
+            return -1;
+        if (write) {
+            copy_bytes(b->data, buf + done, len - done);
+            bdirty(b);
+        } else {
+            copy_bytes(buf + done, b->data, len - done);
+        }
+        brelse(b);
+        done = len;
     }
 
-    return NULL;
+    return done;
 }
 
-int fatRead(struct file *f, uint8_t *buf, uint32_t len) {
-    uint32_t bytes_read = 0;
-    uint32_t cluster = f->start_cluster;
+// Move len bytes between buf and f at its current offset, then advance the
+// offset. The caller has made sure the clusters are there. Returns the
+// number of bytes moved, or -1 on a disk error.
+static int file_io(int write, struct file *f, uint8_t *buf, uint32_t len) {
+    uint32_t done = 0;
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
+
+    // With an extent map every run is a binary search away
+    if (f->extents != NULL) {
+        while (done < len) {
+            uint32_t pos = f->offset + done;
+            struct fat_extent *e = find_extent(f, pos);
+            if (e == NULL)
+                break;  // The directory entry claims more than the chain holds
+            uint32_t in_extent = pos - e->offset;
+
+            int n = span_io(write, e->lba + in_extent / bs->bytes_per_sector,
+                            in_extent % bs->bytes_per_sector,
+                            (e->length - in_extent + bs->bytes_per_sector - 1) / bs->bytes_per_sector,
+                            buf + done, len - done);
+            if (n < 0)
+                return -1;
+            done += n;
+        }
+        f->offset += done;
+        return done;
+    }
 
-    // Calculate where data area starts
-    uint32_t root_dir_sectors = ((bs->num_root_dir_entries * 32) + (bs->bytes_per_sector - 1)) / bs->bytes_per_sector;
-    uint32_t data_start = 2048 + bs->num_reserved_sectors + (bs->num_fat_tables * bs->num_sectors_per_fat) + root_dir_sectors;
+    uint32_t index = f->offset / cluster_bytes;
+    uint32_t cluster = cluster_at(f, index);
 
-    // Start reading the file, following the FAT chain
-    while (cluster < 0xFFF8 && bytes_read < len) {
-        // Compute LBA of this cluster
-        uint32_t first_sector = data_start + (cluster - 2) * bs->num_sectors_per_cluster;
+    // Otherwise follow the FAT chain
+    while (cluster < FAT_EOC && done < len) {
+        uint32_t in_cluster = (f->offset + done) % cluster_bytes;
 
-        // Read each sector in this cluster
-        for (uint32_t s = 0; s < bs->num_sectors_per_cluster && bytes_read < len; s++) {
-            ata_lba_read(first_sector + s, buf + bytes_read, 1);
-            bytes_read += bs->bytes_per_sector;
+        // Collect the run of physically consecutive clusters starting here,
+        // but no more than we need
+        uint32_t first_cluster = cluster;
+        uint32_t run = 1;
+        uint32_t next = fat_entry(cluster);
+        while (next == cluster + 1 && run * cluster_bytes - in_cluster < len - done) {
+            cluster = next;
+            next = fat_entry(cluster);
+            run++;
         }
 
+        int n = span_io(write, cluster_to_lba(first_cluster) + in_cluster / bs->bytes_per_sector,
+                        in_cluster % bs->bytes_per_sector,
+                        run * bs->num_sectors_per_cluster - in_cluster / bs->bytes_per_sector,
+                        buf + done, len - done);
+        if (n < 0)
+            return -1;
+        done += n;
+
+        // Leave the cursor on the last cluster we touched, so the next
+        // sequential access picks up from here
+        index += run;
+        f->cur_index = index - 1;
+        f->cur_cluster = cluster;
+
         // Follow FAT chain
-        cluster = ((uint16_t*)fat_table)[cluster];
+        cluster = next;
+    }
+
+    f->offset += done;
+    return done;
+}
+
+// Find the sector holding offset in f, and how many bytes from there on are
+// contiguous on disk. Returns -1 if the chain ends before offset. May move
+// the cursor.
+static int offset_to_lba(struct file *f, uint32_t offset, uint32_t *lba, uint32_t *avail) {
+    if (f->extents != NULL) {
+        struct fat_extent *e = find_extent(f, offset);
+        if (e == NULL)
+            return -1;
+        *lba = e->lba + (offset - e->offset) / bs->bytes_per_sector;
+        *avail = e->length - (offset - e->offset);
+        return 0;
+    }
+
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
+    uint32_t cluster = cluster_at(f, offset / cluster_bytes);
+    if (cluster >= FAT_EOC)
+        return -1;
+    *lba = cluster_to_lba(cluster) + (offset % cluster_bytes) / bs->bytes_per_sector;
+    *avail = cluster_bytes - offset % cluster_bytes;
+    return 0;
+}
+
+// Keep f->ra_window clusters past the one holding the offset in the block
+// cache. Only tops up once less than half the window is left, so a stream
+// of small reads turns into a few large commands. Best effort: errors are
+// left for the read that actually needs the data.
+static void readahead(struct file *f) {
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
+
+    if (f->ra_window == 0)
+        return;
+    if (f->ra_end > f->offset && f->ra_end - f->offset >= f->ra_window * cluster_bytes / 2)
+        return;
+
+    uint32_t end = (f->offset / cluster_bytes + 1 + f->ra_window) * cluster_bytes;
+    if (end > f->rde.file_size) end = f->rde.file_size;
+    uint32_t pos = f->ra_end > f->offset ? f->ra_end : f->offset;
+    pos -= pos % bs->bytes_per_sector;
+
+    // Walking the chain ahead mustn't lose the cursor the next read uses
+    uint32_t cur_index = f->cur_index;
+    uint32_t cur_cluster = f->cur_cluster;
+
+    // Merge physically consecutive pieces into as few reads as we can
+    uint32_t run_lba = 0;
+    uint32_t run_len = 0;
+    while (pos < end) {
+        uint32_t lba, avail;
+        if (offset_to_lba(f, pos, &lba, &avail) != 0)
+            break;
+        uint32_t n = avail < end - pos ? avail : end - pos;
+        uint32_t sectors = (n + bs->bytes_per_sector - 1) / bs->bytes_per_sector;
+
+        if (run_len > 0 && run_lba + run_len == lba) {
+            run_len += sectors;
+        } else {
+            if (run_len > 0)
+                breadahead(run_lba, run_len);
+            run_lba = lba;
+            run_len = sectors;
+        }
+        pos += n;
+    }
+    if (run_len > 0)
+        breadahead(run_lba, run_len);
+
+    f->cur_index = cur_index;
+    f->cur_cluster = cur_cluster;
+    f->ra_end = pos;
+}
+
+// Read up to len bytes from the current offset and advance it. Returns the
+// number of bytes read, 0 at end of file, or -1 on a disk error.
+int fatRead(struct file *f, uint8_t *buf, uint32_t len) {
+    // Don't read past the end of the file
+    if (f->offset >= f->rde.file_size)
+        return 0;
+    if (len > f->rde.file_size - f->offset)
+        len = f->rde.file_size - f->offset;
+
+    // Grow the readahead window while reads carry on where the last one
+    // stopped, and shrink it when they jump around
+    if (f->offset == f->ra_next) {
+        if (f->ra_window == 0)
+            f->ra_window = 1;
+        else if (f->ra_window < ra_max_clusters)
+            f->ra_window *= 2;
+        if (f->ra_window > ra_max_clusters)
+            f->ra_window = ra_max_clusters;
+    } else {
+        f->ra_window /= 2;
+        f->ra_end = f->offset;
+    }
+
+    int n = file_io(0, f, buf, len);
+    if (n > 0) {
+        f->ra_next = f->offset;
+        readahead(f);
+    }
+    return n;
+}
+
+// Make sure f has at least clusters clusters, allocating more on the end of
+// its chain as contiguously as we can. Returns how many it has, which is
+// less than asked for if the volume filled up. *changed is set if the chain
+// grew.
+static uint32_t extend_chain(struct file *f, uint32_t clusters, int *changed) {
+    uint32_t have = 0;
+    uint32_t last = 0;
+
+    // Find the tail, starting from the cursor if it's still on the chain
+    if (f->start_cluster >= 2) {
+        if (f->cur_cluster < 2 || f->cur_cluster >= FAT_EOC) {
+            f->cur_index = 0;
+            f->cur_cluster = f->start_cluster;
+        }
+        have = f->cur_index + 1;
+        last = f->cur_cluster;
+        uint32_t next;
+        while ((next = fat_entry(last)) >= 2 && next < FAT_EOC) {
+            last = next;
+            have++;
+        }
+        f->cur_index = have - 1;
+        f->cur_cluster = last;
+    }
+
+    while (have < clusters) {
+        uint32_t got;
+        uint32_t first = alloc_run(last ? last + 1 : alloc_hint, clusters - have, &got);
+        if (first == 0)
+            break;
+
+        for (uint32_t i = 0; i < got; i++)
+            fat_set_entry(first + i, (i + 1 < got) ? first + i + 1 : FAT_EOC_MARK);
+        if (last != 0) {
+            fat_set_entry(last, first);
+        } else {
+            f->start_cluster = first;
+            set_entry_cluster(&f->rde, first);
+            f->cur_index = 0;
+            f->cur_cluster = first;
+        }
+        last = first + got - 1;
+        have += got;
+        *changed = 1;
+    }
+    return have;
+}
+
+// Update f's directory entry in the cache. Every other handle on the same
+// file, and the dentry cache, get the new size and first cluster; if the
+// chain changed their extent maps are rebuilt and cursors reset.
+static int write_dirent(struct file *f, int chain_changed) {
+    struct buf *b = bread(f->entry_lba);
+    if (b == NULL)
+        return -1;
+    ((struct root_directory_entry *)b->data)[f->entry_index] = f->rde;
+    bdirty(b);
+    brelse(b);
+
+    dcache_insert(f->dir_cluster, (const char *)&f->rde, &f->rde, f->entry_lba, f->entry_index);
+
+    for (struct file *g = open_files; g != NULL; g = g->next) {
+        if (g->entry_lba != f->entry_lba || g->entry_index != f->entry_index)
+            continue;
+        if (g != f) {
+            g->rde = f->rde;
+            g->start_cluster = f->start_cluster;
+            if (g->offset > g->rde.file_size)
+                g->offset = g->rde.file_size;
+        }
+        if (chain_changed) {
+            if (g != f) {
+                g->cur_index = 0;
+                g->cur_cluster = g->start_cluster;
+            }
+            if (g->extents != NULL)
+                kfree(g->extents);
+            build_extents(g);
+        }
+    }
+    return 0;
+}
+
+// Write len bytes at the current offset and advance it, growing the file
+// as needed. Clusters are only allocated when a write reaches them.
+// Returns the number of bytes written, which is short if the volume fills
+// up, or -1 on a disk error or if nothing could be written.
+int fatWrite(struct file *f, const uint8_t *buf, uint32_t len) {
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
+    int chain_changed = 0;
+
+    if (len == 0)
+        return 0;
+    if (f->offset + len < f->offset)
+        return -1;
+
+    // Allocate whatever the write runs into, keeping only what fits
+    uint32_t need = (f->offset + len + cluster_bytes - 1) / cluster_bytes;
+    uint32_t have = extend_chain(f, need, &chain_changed);
+    if (have < need) {
+        if (have * cluster_bytes <= f->offset)
+            len = 0;
+        else
+            len = have * cluster_bytes - f->offset;
+    }
+    if (chain_changed) {
+        if (f->extents != NULL)
+            kfree(f->extents);
+        build_extents(f);
+    }
+
+    int n = 0;
+    if (len > 0)
+        n = file_io(1, f, (uint8_t *)buf, len);
+
+    int size_changed = 0;
+    if (n > 0 && f->offset > f->rde.file_size) {
+        f->rde.file_size = f->offset;
+        size_changed = 1;
+    }
+
+    if ((size_changed || chain_changed) && write_dirent(f, chain_changed) != 0)
+        return -1;
+
+    return (n > 0) ? n : -1;
+}
+
+// Set the size of f. Shrinking frees the clusters past the new end;
+// growing fills the gap with zeros. The offset is pulled back if it's past
+// the new end. Returns 0, or -1 if we couldn't write.
+int fatTruncate(struct file *f, uint32_t size) {
+    uint32_t cluster_bytes = bs->num_sectors_per_cluster * bs->bytes_per_sector;
+
+    if (size > f->rde.file_size) {
+        static const uint8_t zeros[SECTOR_SIZE];
+        uint32_t offset = f->offset;
+
+        f->offset = f->rde.file_size;
+        while (f->offset < size) {
+            uint32_t n = size - f->offset;
+            if (n > sizeof(zeros)) n = sizeof(zeros);
+            if (fatWrite(f, zeros, n) != (int)n) {
+                f->offset = offset;
+                return -1;
+            }
+        }
+        f->offset = offset;
+        return 0;
+    }
+
+    // Cut the chain after the last cluster we keep
+    uint32_t keep = (size + cluster_bytes - 1) / cluster_bytes;
+    if (keep == 0) {
+        free_chain(f->start_cluster);
+        f->start_cluster = 0;
+        set_entry_cluster(&f->rde, 0);
+    } else {
+        uint32_t last = cluster_at(f, keep - 1);
+        if (last >= 2 && last < FAT_EOC) {
+            uint32_t next = fat_entry(last);
+            if (next >= 2 && next < FAT_EOC) {
+                fat_set_entry(last, FAT_EOC_MARK);
+                free_chain(next);
+            }
+        }
     }
 
-    // If the buffer wasn't big enough, return the correct amount read
-    return (bytes_read > len) ? len : bytes_read;
+    f->rde.file_size = size;
+    f->cur_index = 0;
+    f->cur_cluster = f->start_cluster;
+    if (f->offset > size)
+        f->offset = size;
+
+    return write_dirent(f, 1);
+}
+
+// Find a free entry in directory dir, growing a subdirectory by a cluster
+// if it's full. Returns 0 and the entry's position, or -1 if there's no
+// room.
+static int dir_alloc_entry(uint32_t dir, uint32_t *lba, uint32_t *index) {
+    struct dir_iter it;
+    uint32_t sector;
+
+    dir_iter_start(&it, dir);
+    while ((sector = dir_iter_next(&it)) != 0) {
+        struct buf *b = bread(sector);
+        if (b == NULL)
+            return -1;
+        struct root_directory_entry *entry = (struct root_directory_entry *)b->data;
+
+        for (int j = 0; j < bs->bytes_per_sector / sizeof(struct root_directory_entry); j++) {
+            if (entry[j].file_name[0] == 0x00 || (uint8_t)entry[j].file_name[0] == 0xE5) {
+                *lba = sector;
+                *index = j;
+                brelse(b);
+                return 0;
+            }
+        }
+        brelse(b);
+    }
+
+    // The FAT16 root directory can't grow
+    if (it.dir == 0)
+        return -1;
+
+    uint32_t got;
+    uint32_t cluster = alloc_run(it.cluster + 1, 1, &got);
+    if (cluster == 0)
+        return -1;
+
+    // A fresh directory cluster has to read as all end markers
+    static const uint8_t zeros[SECTOR_SIZE];
+    uint32_t first = cluster_to_lba(cluster);
+    for (uint32_t s = 0; s < bs->num_sectors_per_cluster; s++) {
+        if (blk_write(first + s, (uint8_t *)zeros, 1) != 0)
+            return -1;
+        bcache_invalidate(first + s, zeros, 1);
+    }
+
+    fat_set_entry(cluster, FAT_EOC_MARK);
+    fat_set_entry(it.cluster, cluster);
+
+    *lba = first;
+    *index = 0;
+    return 0;
 }
 
+// Create an empty file at path and open it. An existing file is opened and
+// truncated to nothing instead. The directory it goes in must exist.
+// Returns NULL if it can't be created.
+struct file *fatCreate(const char *path) {
+    struct root_directory_entry rde;
+    uint32_t dir, lba, index;
+    char name[11];
+
+    int r = walk_path(path, &dir, name, &rde, &lba, &index);
+    if (r == -2)
+        return NULL;
+
+    if (r == 0) {
+        if (rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+            return NULL;
+        struct file *f = open_entry(dir, &rde, lba, index);
+        if (f != NULL && fatTruncate(f, 0) != 0) {
+            fatClose(f);
+            return NULL;
+        }
+        return f;
+    }
+
+    if (dir_alloc_entry(dir, &lba, &index) != 0)
+        return NULL;
+
+    uint8_t *p = (uint8_t *)&rde;
+    for (uint32_t i = 0; i < sizeof(rde); i++) p[i] = 0;
+    copy_bytes(&rde, name, 11);
+    rde.attribute = FILE_ATTRIBUTE_ARCHIVE;
+
+    struct buf *b = bread(lba);
+    if (b == NULL)
+        return NULL;
+    ((struct root_directory_entry *)b->data)[index] = rde;
+    bdirty(b);
+    brelse(b);
+
+    // Replaces the negative entry the lookup above left behind
+    dcache_insert(dir, name, &rde, lba, index);
+    return open_entry(dir, &rde, lba, index);
+}
+
+// Delete the file at path and free its clusters. Returns 0, -1 if there's
+// no such file, -2 if it's a directory, -3 if it's open, or -4 on a disk
+// error.
+int fatDelete(const char *path) {
+    struct root_directory_entry rde;
+    uint32_t dir, lba, index;
+    char name[11];
+
+    if (walk_path(path, &dir, name, &rde, &lba, &index) != 0)
+        return -1;
+    if (rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+        return -2;
+    for (struct file *f = open_files; f != NULL; f = f->next) {
+        if (f->entry_lba == lba && f->entry_index == index)
+            return -3;
+    }
+
+    struct buf *b = bread(lba);
+    if (b == NULL)
+        return -4;
+    ((struct root_directory_entry *)b->data)[index].file_name[0] = 0xE5;
+    bdirty(b);
+    brelse(b);
+
+    free_chain(entry_cluster(&rde));
+    dcache_insert(dir, name, NULL, 0, 0);
+    return 0;
+}
+
+// Count the clusters in the chain starting at cluster, and the pieces of
+// physically consecutive clusters they're in
+static void chain_stats(uint32_t cluster, uint32_t *clusters, uint32_t *fragments) {
+    uint32_t n = 0;
+    uint32_t runs = 0;
+    uint32_t prev = 0;
+
+    // A chain can't be longer than the FAT, don't go round a loop forever
+    while (cluster >= 2 && cluster < FAT_EOC && n < fat_num_entries) {
+        if (n == 0 || cluster != prev + 1)
+            runs++;
+        prev = cluster;
+        n++;
+        cluster = fat_entry(cluster);
+    }
+    *clusters = n;
+    *fragments = runs;
+}
+
+// Add every file and directory in dir, and below it, to r. Entries are
+// copied out one at a time so no buffer is held while we recurse.
+static int frag_scan_dir(uint32_t dir, int depth, struct fat_frag_report *r,
+                         void (*fn)(uint32_t dir, const struct root_directory_entry *rde, uint32_t clusters, uint32_t fragments)) {
+    struct dir_iter it;
+    uint32_t sector;
+
+    dir_iter_start(&it, dir);
+    while ((sector = dir_iter_next(&it)) != 0) {
+        for (int j = 0; j < bs->bytes_per_sector / sizeof(struct root_directory_entry); j++) {
+            struct buf *b = bread(sector);
+            if (b == NULL)
+                return -1;
+            struct root_directory_entry rde = ((struct root_directory_entry *)b->data)[j];
+            brelse(b);
+
+            if (rde.file_name[0] == 0x00)
+                return 0;
+            // Skip deleted entries, long name pieces, the volume label, . and ..
+            if ((uint8_t)rde.file_name[0] == 0xE5 || (rde.attribute & FILE_ATTRIBUTE_VOLUME_ID) || rde.file_name[0] == '.')
+                continue;
+
+            uint32_t first = entry_cluster(&rde);
+            if (first < 2)
+                continue;
+
+            uint32_t clusters, fragments;
+            chain_stats(first, &clusters, &fragments);
+            r->files++;
+            r->clusters += clusters;
+            r->fragments += fragments;
+            if (fragments > 1)
+                r->fragmented++;
+            if (fn != NULL)
+                fn(dir, &rde, clusters, fragments);
+
+            if ((rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY) && depth < FAT_MAX_DEPTH &&
+                frag_scan_dir(first, depth + 1, r, fn) != 0)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+// Walk every directory on the volume and fill in r. fn, if not NULL, is
+// called for each file and directory with the directory it's in, its entry
+// and how many clusters and pieces it has. Returns 0, or -1 if nothing is
+// mounted or a directory couldn't be read, in which case r only covers what
+// we got through.
+int fatFragReport(struct fat_frag_report *r,
+                  void (*fn)(uint32_t dir, const struct root_directory_entry *rde, uint32_t clusters, uint32_t fragments)) {
+    r->files = 0;
+    r->fragmented = 0;
+    r->clusters = 0;
+    r->fragments = 0;
+    r->free_clusters = 0;
+    r->free_runs = 0;
+    r->largest_free_run = 0;
+    if (!fat_mounted)
+        return -1;
+
+    uint32_t run = 0;
+    for (uint32_t c = 2; c < fat_num_entries; c++) {
+        if (cluster_in_use(c)) {
+            run = 0;
+            continue;
+        }
+        if (run == 0)
+            r->free_runs++;
+        run++;
+        r->free_clusters++;
+        if (run > r->largest_free_run)
+            r->largest_free_run = run;
+    }
+
+    return frag_scan_dir(0, 0, r, fn);
+}
+
+// Copy count sectors from src to dst through the block cache, reading the
+// source ahead a batch at a time. Returns 0, or -1 on a disk error.
+static int copy_sectors(uint32_t src, uint32_t dst, uint32_t count) {
+    for (uint32_t s = 0; s < count; s++) {
+        if (s % CONFIG_BCACHE_READAHEAD_MAX == 0) {
+            uint32_t n = count - s;
+            if (n > CONFIG_BCACHE_READAHEAD_MAX) n = CONFIG_BCACHE_READAHEAD_MAX;
+            if (breadahead(src + s, n) < 0)
+                return -1;
+        }
+
+        struct buf *from = bread(src + s);
+        if (from == NULL)
+            return -1;
+        struct buf *to = bget(dst + s);
+        if (to == NULL) {
+            brelse(from);
+            return -1;
+        }
+        copy_bytes(to->data, from->data, bs->bytes_per_sector);
+        bdirty(to);
+        brelse(to);
+        brelse(from);
+    }
+    return 0;
+}
+
+// Move the file at path into one run of contiguous clusters, so reading it
+// takes as few commands as the drive allows instead of one per piece. The data is
+// copied through the block cache. The copy and its FAT chain reach the disk
+// before the directory entry points at them, and the old clusters are only
+// freed after that, so a crash at any point leaves the old or the new copy
+// intact, at worst with the other one's clusters leaked. Open handles
+// follow the move. Returns 0, also if there was nothing to do, -1 if
+// nothing is mounted or there's no such file, -2 if it's a directory, -3 if there's no free run
+// big enough, or -4 on a disk error.
+int fatDefrag(const char *path) {
+    struct root_directory_entry rde;
+    uint32_t dir, lba, index;
+    char name[11];
+
+    if (!fat_mounted)
+        return -1;
+    if (walk_path(path, &dir, name, &rde, &lba, &index) != 0)
+        return -1;
+    if (rde.attribute & FILE_ATTRIBUTE_SUBDIRECTORY)
+        return -2;
+
+    uint32_t old = entry_cluster(&rde);
+    uint32_t clusters, fragments;
+    chain_stats(old, &clusters, &fragments);
+    if (fragments <= 1)
+        return 0;
+
+    // The file's own clusters are in use, so this never overlaps them
+    uint32_t best = 0, best_len = 0;
+    uint32_t first = find_free_run(2, fat_num_entries, clusters, &best, &best_len);
+    if (first == 0)
+        return -3;
+    for (uint32_t i = 0; i < clusters; i++) mark_cluster(first + i, 1);
+    fat_free_clusters -= clusters;
+
+    // Copy a piece of the old chain at a time
+    uint32_t dst = cluster_to_lba(first);
+    uint32_t c = old;
+    while (c >= 2 && c < FAT_EOC) {
+        uint32_t run = 1;
+        uint32_t next = fat_entry(c);
+        while (next == c + run) {
+            next = fat_entry(next);
+            run++;
+        }
+        uint32_t sectors = run * bs->num_sectors_per_cluster;
+        if (copy_sectors(cluster_to_lba(c), dst, sectors) != 0) {
+            for (uint32_t i = 0; i < clusters; i++) mark_cluster(first + i, 0);
+            fat_free_clusters += clusters;
+            return -4;
+        }
+        dst += sectors;
+        c = next;
+    }
+
+    for (uint32_t i = 0; i < clusters; i++)
+        fat_set_entry(first + i, (i + 1 < clusters) ? first + i + 1 : FAT_EOC_MARK);
+    if (fatSync() != 0)
+        return -4;
+
+    // Point the entry at the copy, through an open handle if there is one
+    struct file *f = open_files;
+    while (f != NULL && !(f->entry_lba == lba && f->entry_index == index)) f = f->next;
+    struct file *tmp = NULL;
+    if (f == NULL) {
+        tmp = f = open_entry(dir, &rde, lba, index);
+        if (f == NULL)
+            return -4;
+    }
+    f->start_cluster = first;
+    set_entry_cluster(&f->rde, first);
+    f->cur_index = 0;
+    f->cur_cluster = first;
+    int r = write_dirent(f, 1);
+    if (tmp != NULL)
+        fatClose(tmp);
+    if (r != 0 || fatSync() != 0)
+        return -4;
+
+    free_chain(old);
+    return 0;
+}
+
+// Write everything we've been holding back to disk: the FAT, to every
+// copy, then directory and data sectors. The FATs come before the root
+// directory and data area on disk, so this is one pass in LBA order. Then
+// flush the drive's write cache, so when this returns it's all on the
+// media. Returns 0, or -1 if anything couldn't be written.
+int fatSync(void) {
+    int r = 0;
+    if (fat_cache_flush() != 0)
+        r = -1;
+    if (fsinfo_sync() != 0 || bsync() != 0)
+        r = -1;
+    if (blk_flush() != 0)
+        r = -1;
+    return r;
+}
+
+// Periodic write back, call with the current tick count. Flushes once
+// CONFIG_FAT_WRITEBACK_TICKS have passed since the last time. Not safe to
+// call from an interrupt handler, a disk operation may be in progress.
+void fatWriteback(uint32_t now) {
+    if (now - last_writeback < CONFIG_FAT_WRITEBACK_TICKS)
+        return;
+    last_writeback = now;
+
+    // Nothing held back. blk_flush() skips the drive's cache by itself if
+    // nothing was written since the last flush.
+    if (fat_num_dirty == 0 && bcache_dirty() == 0 &&
+        (fsinfo_lba == 0 || fsinfo_free == fat_free_clusters))
+        return;
+    fatSync();
+}
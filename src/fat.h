@@ -7,7 +7,34 @@
 #define CLUSTER_SIZE 4096
 #define SECTORS_PER_CLUSTER (CLUSTER_SIZE/SECTOR_SIZE)
 
+#define FILE_ATTRIBUTE_VOLUME_ID 0x08   // Also set on long file name entries
 #define FILE_ATTRIBUTE_SUBDIRECTORY 0x10
+#define FILE_ATTRIBUTE_ARCHIVE 0x20
+
+// What fat_entry() returns for the last cluster of a chain, for FAT16 and
+// FAT32 alike. Anything at or above FAT_EOC ends a chain.
+#define FAT_EOC      0x0FFFFFF8
+#define FAT_EOC_MARK 0x0FFFFFFF
+
+#ifndef CONFIG_FAT_MAX_OPEN
+#define CONFIG_FAT_MAX_OPEN 32      // Size of the open file table
+#endif
+
+#ifndef CONFIG_FAT_WRITEBACK_TICKS
+#define CONFIG_FAT_WRITEBACK_TICKS 500  // fatWriteback() flushes at most this often (5 s at 100 Hz)
+#endif
+
+#ifndef CONFIG_FAT_MAX_EXTENTS
+#define CONFIG_FAT_MAX_EXTENTS 64   // Files with more runs than this don't get an extent map
+#endif
+
+#ifndef CONFIG_FAT_READAHEAD_MAX
+#define CONFIG_FAT_READAHEAD_MAX 16 // Largest readahead window, in clusters
+#endif
+
+#ifndef CONFIG_FAT_CACHE_PAGES
+#define CONFIG_FAT_CACHE_PAGES 16   // Most pages of the FAT kept in memory at once
+#endif
 
 /*
  * Data structure definitions.
@@ -36,16 +63,58 @@ struct boot_sector {
     uint16_t num_heads;
     uint32_t num_hidden_sectors;
     uint32_t total_sectors_in_fs;
-    uint8_t logical_drive_num;
-    uint8_t reserved;
-    uint8_t extended_signature;
-    uint32_t serial_number;
-    char volume_label[11];
-    char fs_type[8];
-    char boot_code[448];
+    union {
+        // FAT12/16 extended BPB
+        struct {
+            uint8_t logical_drive_num;
+            uint8_t reserved;
+            uint8_t extended_signature;
+            uint32_t serial_number;
+            char volume_label[11];
+            char fs_type[8];
+            char boot_code[448];
+        }__attribute__((packed));
+        // FAT32 extended BPB, num_sectors_per_fat and num_root_dir_entries are 0
+        struct {
+            uint32_t num_sectors_per_fat32;
+            uint16_t ext_flags;
+            uint16_t fs_version;
+            uint32_t root_cluster;      // First cluster of the root directory
+            uint16_t fsinfo_sector;     // Relative to the start of the partition
+            uint16_t backup_boot_sector;
+            uint8_t reserved32[12];
+            uint8_t logical_drive_num32;
+            uint8_t reserved32b;
+            uint8_t extended_signature32;
+            uint32_t serial_number32;
+            char volume_label32[11];
+            char fs_type32[8];
+            char boot_code32[420];
+        }__attribute__((packed));
+    };
     uint16_t boot_signature;
 }__attribute__((packed));
 
+/*
+ * FAT32 FSInfo sector. The free count and next free cluster are only hints,
+ * 0xFFFFFFFF if unknown.
+ *
+ */
+#define FSINFO_LEAD_SIG   0x41615252
+#define FSINFO_STRUCT_SIG 0x61417272
+#define FSINFO_TRAIL_SIG  0xAA550000
+#define FSINFO_UNKNOWN    0xFFFFFFFF  // free_count or next_free not known
+
+struct fsinfo {
+    uint32_t lead_signature;
+    uint8_t reserved1[480];
+    uint32_t struct_signature;
+    uint32_t free_count;
+    uint32_t next_free;
+    uint8_t reserved2[12];
+    uint32_t trail_signature;
+}__attribute__((packed));
+
 /*
  * Root directory entry used to store info about a file. These data structures
  * are packed in the root directory.
@@ -60,27 +129,87 @@ struct root_directory_entry {
     uint16_t creation_time;
     uint16_t creation_date;
     uint16_t access_date;
-    uint16_t reserved2;
+    uint16_t cluster_high;  // FAT32 only, top 16 bits of the first cluster
     uint16_t modified_time;
     uint16_t modified_date;
     uint16_t cluster;
     uint32_t file_size;
 };
 
+/*
+ * A run of physically consecutive clusters in a file. length is in bytes
+ * and always a whole number of clusters.
+ *
+ */
+struct fat_extent {
+    uint32_t offset;    // File offset of the first byte
+    uint32_t lba;       // First sector on disk
+    uint32_t length;
+    uint32_t cluster;   // First cluster
+};
+
 /*
  *
  * Stores info about an open file
  *
  */
 struct file {
-    struct file *next;
+    struct file *next;      // Open file list, or the free list in the pool
     struct file *prev;
     struct root_directory_entry rde;
     uint32_t start_cluster;
+    uint32_t refcount;      // 0 while the handle is in the pool
+    uint32_t offset;        // Current position in the file
+    uint32_t cur_index;     // Cursor: index of cur_cluster within the file
+    uint32_t cur_cluster;   // Cursor: cluster number at cur_index
+    struct fat_extent *extents;  // Sorted by offset, NULL to walk the chain instead
+    uint32_t num_extents;
+    uint32_t dir_cluster;   // Directory holding the file, 0 for the root
+    uint32_t entry_lba;     // Where rde lives on disk
+    uint32_t entry_index;
+    uint32_t ra_next;       // Readahead: where a sequential read would start
+    uint32_t ra_window;     // Readahead: clusters to keep ahead of the offset, 0 for none
+    uint32_t ra_end;        // Readahead: issued up to here
+};
+
+/*
+ * Fragmentation of the whole volume, from fatFragReport(). A piece is a run
+ * of physically consecutive clusters; an unfragmented file is one piece.
+ *
+ */
+struct fat_frag_report {
+    uint32_t files;             // Files and directories that have clusters
+    uint32_t fragmented;        // ...of which are in more than one piece
+    uint32_t clusters;          // Clusters they use
+    uint32_t fragments;         // Pieces they're in
+    uint32_t free_clusters;
+    uint32_t free_runs;         // Pieces the free space is in
+    uint32_t largest_free_run;  // In clusters
 };
 
 int fatInit();
 struct file *fatOpen(const char *filename);
 int fatRead(struct file *f, uint8_t *buf, uint32_t len);
+int fatSeek(struct file *f, uint32_t offset);
+struct file *fatDup(struct file *f);
+int fatClose(struct file *f);
+struct file *fatCreate(const char *path);
+int fatWrite(struct file *f, const uint8_t *buf, uint32_t len);
+int fatTruncate(struct file *f, uint32_t size);
+int fatDelete(const char *path);
+int fatSync(void);
+int fatFragReport(struct fat_frag_report *r,
+                  void (*fn)(uint32_t dir, const struct root_directory_entry *rde, uint32_t clusters, uint32_t fragments));
+int fatDefrag(const char *path);
+void fatWriteback(uint32_t now);
+
+extern struct file *open_files;
+
+// FAT cache, loaded on demand
+uint32_t fat_entry(uint32_t cluster);
+int fat_set_entry(uint32_t cluster, uint32_t value);
+
+extern uint32_t fat_free_clusters;
+extern uint32_t fat_type;       // 16 or 32, set by fatInit()
 
 #endif
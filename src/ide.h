@@ -1,8 +1,186 @@
-
 #ifndef __IDE_H__
 #define __IDE_H__
 
-int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+#include <stdint.h>
+#include "page.h"
 
+// The sector count register is 8 bits, 0 means 256. LBA48 commands write
+// it twice for 16 bits, and there 0 means 65536.
+#define ATA_MAX_SECTORS     256
+#define ATA_MAX_SECTORS_EXT 65536
+#define ATA_LBA28_LIMIT     0x10000000  // First sector LBA28 commands can't reach
+
+#ifndef CONFIG_ATA_MULTIPLE
+#define CONFIG_ATA_MULTIPLE 16  // Most sectors per DRQ block for PIO transfers, 0 for one at a time
 #endif
 
+#ifndef CONFIG_ATA_BSY_SPINS
+#define CONFIG_ATA_BSY_SPINS 100000  // Status reads ata_submit() gives a busy drive, with interrupts off
+#endif
+
+// Primary channel ports. They're at the legacy addresses unless ata_init()
+// finds the controller in native PCI mode; the polling code in ide.s only
+// knows the legacy ones.
+#define ATA_IO_LEGACY  0x1F0
+#define ATA_CTL_LEGACY 0x3F6
+
+#define ATA_DATA     (ata_io_base + 0)
+#define ATA_ERROR    (ata_io_base + 1)
+#define ATA_COUNT    (ata_io_base + 2)
+#define ATA_LBA_LO   (ata_io_base + 3)
+#define ATA_LBA_MID  (ata_io_base + 4)
+#define ATA_LBA_HI   (ata_io_base + 5)
+#define ATA_DRIVE    (ata_io_base + 6)
+#define ATA_STATUS   (ata_io_base + 7)  // Reading it acknowledges the drive's interrupt
+#define ATA_COMMAND  (ata_io_base + 7)
+#define ATA_CONTROL  ata_ctl_base       // Device control, bit 1 (nIEN) masks the drive's interrupt
+
+extern uint16_t ata_io_base;
+extern uint16_t ata_ctl_base;
+
+// Status bits
+#define ATA_SR_ERR  0x01
+#define ATA_SR_DRQ  0x08
+#define ATA_SR_DF   0x20
+#define ATA_SR_BSY  0x80
+
+#define ATA_CMD_READ      0x20
+#define ATA_CMD_WRITE     0x30
+#define ATA_CMD_READ_DMA  0xC8
+#define ATA_CMD_WRITE_DMA 0xCA
+#define ATA_CMD_READ_MULTIPLE  0xC4
+#define ATA_CMD_WRITE_MULTIPLE 0xC5
+#define ATA_CMD_SET_MULTIPLE   0xC6
+#define ATA_CMD_FLUSH_CACHE    0xE7
+#define ATA_CMD_IDENTIFY       0xEC
+
+// LBA48 versions
+#define ATA_CMD_READ_EXT           0x24
+#define ATA_CMD_READ_DMA_EXT       0x25
+#define ATA_CMD_READ_MULTIPLE_EXT  0x29
+#define ATA_CMD_WRITE_EXT          0x34
+#define ATA_CMD_WRITE_DMA_EXT      0x35
+#define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+
+// IDENTIFY DEVICE words we look at
+#define ATA_ID_MODEL        27      // 40 characters, two to a word, high byte first
+#define ATA_ID_MAX_MULTIPLE 47      // Low byte: most sectors per DRQ block
+#define ATA_ID_CAPABILITIES 49      // Bit 8 DMA, bit 9 LBA
+#define ATA_ID_SECTORS      60      // Two words, sectors LBA28 commands can reach
+#define ATA_ID_COMMAND_SET  83      // Bit 10 LBA48
+#define ATA_ID_SECTORS_EXT  100     // Four words, sectors with LBA48
+
+// Bus master IDE registers, offsets from BAR4 of the controller. The
+// primary channel's are the first 8 bytes.
+#define BM_COMMAND  0x0     // Bit 0 starts the transfer, bit 3 set means towards memory
+#define BM_STATUS   0x2     // Bits 1 (error) and 2 (interrupt) are cleared by writing 1
+#define BM_PRDT     0x4     // Physical address of the PRD table
+
+#define BM_CMD_START  0x01
+#define BM_CMD_READ   0x08
+#define BM_SR_ACTIVE  0x01
+#define BM_SR_ERR     0x02
+#define BM_SR_IRQ     0x04
+
+/*
+ * Physical Region Descriptor. A region can't cross a 64 KiB boundary and
+ * a byte count of 0 means 64 KiB. The table itself lives in one PFA frame.
+ *
+ */
+struct prd {
+    uint32_t phys;
+    uint16_t bytes;
+    uint16_t flags;
+}__attribute__((packed));
+
+#define PRD_EOT 0x8000      // Last entry in the table
+#define PRD_MAX (PAGE_SIZE / sizeof(struct prd))
+
+#define ATA_IRQ 14      // Legacy mode IRQ
+extern uint8_t ata_irq_line;    // ...or the PCI one in native mode
+
+#define ATA_PENDING 1   // ata_request status until the transfer finishes
+#define ATA_BUSY   -2   // ata_submit(): the drive is still on another request
+
+// One piece of a transfer gathered from, or scattered into, several buffers
+struct ata_sg {
+    uint8_t *buffer;
+    uint32_t count;     // Sectors
+};
+
+/*
+ * What IDENTIFY DEVICE told ata_init() about drive 0. Until then, or if the
+ * drive doesn't answer, it's the lowest common denominator: LBA28, one
+ * sector per DRQ block, ATA_MAX_SECTORS per command.
+ *
+ */
+struct ata_drive {
+    int identified;
+    int lba48;
+    int dma;
+    uint32_t sectors;       // Capacity, capped at what a uint32_t LBA reaches
+    uint32_t max_multiple;  // Most sectors per DRQ block the drive can do
+    uint32_t multiple;      // ...and what we set it to, 0 if not in use
+    uint32_t max_sectors;   // Per command
+    char model[41];
+};
+
+/*
+ * One transfer for the interrupt driven driver. With bus master DMA the
+ * controller moves the data and the IRQ14 handler only sees the end of it;
+ * otherwise the handler moves each DRQ block as the drive asks for it.
+ * Either way it then sets status to 0, or -1 if the drive reported an
+ * error, and calls done if there is one. done runs in interrupt context.
+ * A flush request moves no data and only waits for the drive's write
+ * cache to reach the media.
+ *
+ */
+struct ata_request {
+    uint32_t lba;
+    uint8_t *buffer;
+    struct ppage *frames;           // If not NULL, scatter into these frames instead of buffer
+    const struct ata_sg *sg;        // Or if not NULL, into these nsg pieces
+    uint32_t nsg;
+    uint32_t count;                 // Sectors, 1 to ata_drive.max_sectors
+    int write;
+    int flush;                      // FLUSH CACHE instead of a transfer, the rest is ignored
+    int dma;                        // Set by ata_submit() if bus mastering moves the data
+    uint32_t block;                 // Sectors per DRQ block, set by ata_submit()
+    volatile uint32_t remaining;    // Sectors not moved yet
+    volatile int status;
+    void (*done)(struct ata_request *rq);
+};
+
+struct ata_stats {
+    uint32_t commands;
+    uint32_t dma;           // ...of which were bus master transfers
+    uint32_t lba48;         // ...of which used LBA48 commands
+    uint32_t flushes;
+    uint32_t irqs;
+    uint32_t spurious;      // IRQs with no transfer in progress
+    uint32_t errors;
+    uint32_t timeouts;      // Commands not started, or failed, because BSY never dropped
+};
+
+extern struct ata_stats ata_stats;
+extern struct ata_drive ata_drive;
+
+void ata_init(void);
+void ata_irq(void);
+int ata_submit(struct ata_request *rq);
+void ata_set_idle_hook(void (*fn)(void));
+int ata_wait(struct ata_request *rq);
+
+int ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_lba_write(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_read_frames(unsigned int lba, struct ppage *frames, unsigned int numsectors);
+int ata_write_frames(unsigned int lba, struct ppage *frames, unsigned int numsectors);
+int ata_flush(void);
+int ata_flush_pending(void);
+
+// Busy-polling LBA28 versions in ide.s, used before ata_init()
+int ata_pio_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+int ata_pio_write(unsigned int lba, unsigned char *buffer, unsigned int numsectors);
+
+#endif
@@ -59,8 +59,11 @@
 ; Lots of info from:
 ; https://wiki.osdev.org/ATA_PIO_Mode
 ;
+; Busy-polls with drive interrupts off. Used until ata_init() switches
+; ata_lba_read() in ata.c over to the IRQ14 driver.
+;
 ; C Prototype:
-; ata_lba_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors)
+; ata_pio_read(unsigned int lba, unsigned char *buffer, unsigned int numsectors)
 ;
 ; |-------------------------------|
 ; |      Num Sectors to Read      |
@@ -78,8 +81,8 @@
 ;
 ;=============================================================================
     [BITS 32]
-    global ata_lba_read
-ata_lba_read:
+    global ata_pio_read
+ata_pio_read:
     push ebp
     mov ebp,esp
     push eax
@@ -183,3 +186,112 @@ ata_lba_read:
     ret
 
 
+;=============================================================================
+; ATA write sectors (LBA mode)
+;
+; @param EAX Logical Block Address of sector
+; @param CL  Number of sectors to write
+; @param RSI The address of data to write to the disk
+;
+; @return 0 on success, -1 if the drive reported an error
+;
+; Same register layout and stack frame as ata_pio_read, just the other
+; direction. The drive wants DRQ checked before every sector.
+;
+; C Prototype:
+; ata_pio_write(unsigned int lba, unsigned char *buffer, unsigned int numsectors)
+;
+;=============================================================================
+    global ata_pio_write
+ata_pio_write:
+    push ebp
+    mov ebp,esp
+    push eax
+    push ebx
+    push ecx
+    push edx
+    push esi
+
+    mov edx, 0x03F6      ; Digital output register
+    mov al,2             ; Disable interrupts
+    out dx,al
+
+    mov eax,[8+ebp]      ; Get LBA in EAX
+    mov esi,[12+ebp]     ; Get buffer in ESI
+    mov ecx,[16+ebp]     ; Get sector count in ECX
+    and eax, 0x0FFFFFFF
+    mov ebx, eax         ; Save LBA in RBX
+
+    mov edx, 0x01F6      ; Port to send drive and bit 24 - 27 of LBA
+    shr eax, 24          ; Get bit 24 - 27 in al
+    or al, 11100000b     ; Set bit 6 in al for LBA mode
+    out dx, al
+
+    mov edx, 0x01F2      ; Port to send number of sectors
+    mov al, cl           ; Get number of sectors from CL
+    out dx, al
+
+    mov edx, 0x1F3       ; Port to send bit 0 - 7 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    out dx, al
+
+    mov edx, 0x1F4       ; Port to send bit 8 - 15 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    shr eax, 8           ; Get bit 8 - 15 in AL
+    out dx, al
+
+    mov edx, 0x1F5       ; Port to send bit 16 - 23 of LBA
+    mov eax, ebx         ; Get LBA from EBX
+    shr eax, 16          ; Get bit 16 - 23 in AL
+    out dx, al
+
+    mov edx, 0x1F7       ; Command port
+    mov al, 0x30         ; Write with retry.
+    out dx, al
+
+; wait for BSY clear and DRQ set before each sector
+.piow_l:
+    in al, dx       ; grab a status byte
+    test al, 0x80       ; BSY flag set?
+    jne short .piow_l
+    test al, 0x21       ; ERR or DF set?
+    jne short .wfail
+    test al, 8      ; DRQ set?
+    je short .piow_l
+
+    mov edx, 0x1F0       ; Data port, in and out
+    mov ecx, 256
+.wr_word:
+    outsw           ; one word at a time, rep outsw is too fast for some drives
+    loop .wr_word
+
+    mov edx,0x1f7   ; "point" dx back at the status register
+    in al, dx       ; delay 400ns to allow drive to set new values of BSY and DRQ
+    in al, dx
+    in al, dx
+    in al, dx
+
+    dec dword [16+ebp]          ; decrement the "sectors to write" count
+    jne short .piow_l
+
+; wait for the drive to finish the last sector
+.piow_done:
+    in al, dx
+    test al, 0x80
+    jne short .piow_done
+    test al, 0x21       ; ERR or DF set?
+    jne short .wfail
+
+    xor eax,eax
+    jmp short .wdone
+
+.wfail:
+    mov eax,-1
+
+.wdone:
+    pop esi
+    pop edx
+    pop ecx
+    pop ebx
+    leave
+    ret
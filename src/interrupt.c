@@ -21,6 +21,10 @@
 
 #include <stdint.h>
 #include "interrupt.h"
+#include "vm.h"
+#include "ide.h"
+
+volatile uint32_t pit_ticks;   // IRQ0 count since init_pit()
 
 struct idt_entry idt_entries[256];
 struct idt_ptr   idt_ptr;
@@ -175,7 +179,6 @@ void write_tss(struct gdt_entry_bits *g) {
     // Firstly, let's compute the base and limit of our entry into the GDT.
     uint32_t base = (uint32_t) &tss_ent;
     uint32_t limit = base + sizeof(struct tss_entry);
-    extern uint32_t stack_top;
 
     // Now, add our TSS descriptor's address to the GDT.
     g->limit_low = limit & 0xFFFF;
@@ -352,9 +355,18 @@ void general_protection_handler(struct interrupt_frame* frame)
     /* do something */
     while(1);
 }
-//void page_fault_handler(struct interrupt_frame* frame)
-void page_fault_handler(struct process_context_with_error* ctx)
+// The CPU pushes an error code for page faults, so the handler takes it as
+// a second argument. CR2 holds the address that faulted.
+__attribute__((interrupt)) void page_fault_handler(struct interrupt_frame* frame, uword_t error_code)
 {
+    uint32_t fault_addr;
+    asm volatile("mov %%cr2,%0" : "=r"(fault_addr));
+
+    // Demand-zero regions get a frame mapped and the access is retried
+    if (vm_handle_fault(fault_addr, error_code) == 0) {
+        return;
+    }
+
     asm("cli");
     while(1);
 }
@@ -376,9 +388,17 @@ __attribute__((interrupt)) void stub_isr(struct interrupt_frame* frame)
 
 __attribute__((interrupt)) void pit_handler(struct interrupt_frame* frame)
 {
-    asm("cli");
-    /* do something */
-    while(1);
+    pit_ticks++;
+    outb(0x20,0x20);
+}
+
+
+// IRQ14, or whichever line the primary ATA channel is on in native PCI
+// mode. PIC_sendEOI() takes care of the slave PIC if it came through there.
+__attribute__((interrupt)) void ide_handler(struct interrupt_frame* frame)
+{
+    ata_irq();
+    PIC_sendEOI(ata_irq_line);
 }
 
 
@@ -445,9 +465,27 @@ void init_idt() {
     idt_set_gate(0x21, (uint32_t)keyboard_handler,0x08, 0x8e);
     idt_set_gate(0x80, (uint32_t)syscall_handler,0x08, 0xee); // Set flags to EE, making DPL = 3 so it is accessible from userspace
     idt_set_gate(32,   (uint32_t)pit_handler, 0x08, 0x8e);
+    idt_set_gate(0x28 + ATA_IRQ - 8, (uint32_t)ide_handler, 0x08, 0x8e);
     idt_flush(&idt_ptr);
 }
 
+// Route PIC line irq to the IDE handler, for a controller in native PCI
+// mode that isn't on IRQ14
+void ide_set_irq(uint8_t irq)
+{
+    idt_set_gate(irq < 8 ? 0x20 + irq : 0x28 + irq - 8, (uint32_t)ide_handler, 0x08, 0x8e);
+}
+
+// Run PIT channel 0 as a rate generator at hz. Unmask IRQ0 to get ticks.
+void init_pit(uint32_t hz)
+{
+    uint32_t divisor = PIT_BASE_HZ / hz;
+
+    outb(PIT_COMMAND, 0x34);    // Channel 0, lobyte/hibyte, mode 2
+    outb(PIT_CHANNEL0, divisor & 0xFF);
+    outb(PIT_CHANNEL0, (divisor >> 8) & 0xFF);
+}
+
 void remap_pic(void)
 {
     /* ICW1 - begin initialization */
@@ -462,9 +500,9 @@ void remap_pic(void)
     outb(PIC_1_DATA, 0x20);
     outb(PIC_2_DATA, 0x28);
 
-    /* ICW3 - setup cascading */
-    outb(PIC_1_DATA, 0x00);
-    outb(PIC_2_DATA, 0x00);
+    /* ICW3 - setup cascading, the slave hangs off IRQ2 */
+    outb(PIC_1_DATA, 0x04);
+    outb(PIC_2_DATA, 0x02);
 
     /* ICW4 - environment info */
     outb(PIC_1_DATA, 0x01);
@@ -5,6 +5,8 @@
 
 #include <stdint.h>
 
+// Type GCC wants for the error code argument of an exception handler
+typedef unsigned int uword_t __attribute__ ((mode (__word__)));
 
 #define PIC_EOI		0x20		 //  End-of-interrupt command code
 #define PIC1		0x20         // IO base address for master PIC
@@ -20,6 +22,11 @@
 #define PIC_1_DATA 0x21
 #define PIC_2_DATA 0xA1
 
+#define PIT_CHANNEL0 0x40
+#define PIT_COMMAND  0x43
+#define PIT_BASE_HZ  1193182  // Input clock of the 8253/8254
+#define PIT_HZ       100      // Rate we run IRQ0 at
+
 
 // A struct describing an interrupt gate.
 struct idt_entry
@@ -155,4 +162,21 @@ void init_idt();
 void tss_flush (uint16_t tss);
 void load_gdt();
 void remap_pic(void);
+void init_pit(uint32_t hz);
+void ide_set_irq(uint8_t irq);
+
+extern volatile uint32_t pit_ticks;
+
+// Interrupts off, returning whether they were on so irq_restore() can put
+// them back
+static inline uint32_t irq_save(void) {
+    uint32_t flags;
+    asm volatile("pushf; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+static inline void irq_restore(uint32_t flags) {
+    if (flags & 0x200)
+        asm volatile("sti" : : : "memory");
+}
 #endif
@@ -2,7 +2,15 @@
 #include "rprintf.h"
 #include "page.h"
 #include "map.h"
+#include "kmalloc.h"
 #include "fat.h"
+#include "bcache.h"
+#include "dcache.h"
+#include "multiboot.h"
+#include "interrupt.h"
+#include "vm.h"
+#include "ide.h"
+#include "blk.h"
 
 #define MULTIBOOT2_HEADER_MAGIC         0xe85250d6
 
@@ -65,7 +73,7 @@ unsigned char keyboard_map[128] =
 
 int x = 0;
 int y = 0;
-struct termbuf *vram = (struct termbuf*)0xB8000;
+struct termbuf *vram = (struct termbuf*)P2V(0xB8000);
 
 void helper() {
 	int arr[] = {65, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76, 77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 88, 89};
@@ -144,7 +152,56 @@ int putc(int data) {
 
 struct ppage * allocd_list = NULL;
 
-void main() {
+// Add [start, end) to the region list, keeping only what lies between 1 MiB
+// and the end of the memory the kernel can map.
+static int add_mem_region(struct pfa_region *regions, int n, int max, uint64_t start, uint64_t end) {
+    if (start < 0x100000) start = 0x100000;
+    if (end > KERNEL_LOWMEM_LIMIT) end = KERNEL_LOWMEM_LIMIT;
+    if (end <= start || n >= max) return n;
+
+    regions[n].start = (uint32_t)start;
+    regions[n].end = (uint32_t)end;
+    return n + 1;
+}
+
+// Walk the Multiboot2 info tags and collect the usable RAM ranges. The memory
+// map is preferred; basic meminfo is only used when there is no map.
+int parse_multiboot_memory(uint32_t mb_info, struct pfa_region *regions, int max) {
+    struct multiboot_tag_basic_meminfo *meminfo = NULL;
+    int have_mmap = 0;
+    int n = 0;
+
+    struct multiboot_tag *tag = (struct multiboot_tag *)(mb_info + sizeof(struct multiboot_info));
+    while (tag->type != MULTIBOOT_TAG_TYPE_END) {
+        if (tag->type == MULTIBOOT_TAG_TYPE_MMAP) {
+            struct multiboot_tag_mmap *mmap = (struct multiboot_tag_mmap *)tag;
+            uint8_t *entry = (uint8_t *)mmap->entries;
+            have_mmap = 1;
+
+            while (entry < (uint8_t *)mmap + mmap->size) {
+                struct multiboot_mmap_entry *e = (struct multiboot_mmap_entry *)entry;
+                if (e->type == MULTIBOOT_MEMORY_AVAILABLE) {
+                    n = add_mem_region(regions, n, max, e->addr, e->addr + e->len);
+                }
+                entry += mmap->entry_size;
+            }
+        } else if (tag->type == MULTIBOOT_TAG_TYPE_BASIC_MEMINFO) {
+            meminfo = (struct multiboot_tag_basic_meminfo *)tag;
+        }
+
+        // Tags are padded to 8 bytes
+        tag = (struct multiboot_tag *)((uint8_t *)tag + ((tag->size + 7) & ~7));
+    }
+
+    if (!have_mmap && meminfo != NULL) {
+        n = add_mem_region(regions, n, max, 0x100000, 0x100000 + (uint64_t)meminfo->mem_upper * 1024);
+    }
+    return n;
+}
+
+// Called from boot.s with the Multiboot2 magic and the physical address of
+// the info structure the bootloader left in EAX and EBX
+void main(uint32_t mb_magic, void *mb_info) {
     // Example putc use
     putc('X');
     putc('\n');
@@ -168,66 +225,102 @@ void main() {
     
     esp_printf(putc, "\n\n\n"); 
    
-    // Initialize the free_list for the PFA
-    init_pfa_list();
+    // Size the PFA from the memory map the bootloader gave us
+    struct pfa_region regions[PFA_MAX_ZONES];
+    int nregions = 0;
+    if (mb_magic == MULTIBOOT2_BOOTLOADER_MAGIC) {
+        nregions = parse_multiboot_memory((uintptr_t)P2V(mb_info), regions, PFA_MAX_ZONES);
+    } else {
+        esp_printf(putc, "No Multiboot2 info, physical memory is unknown!\n");
+    }
+
+    // Initialize the free lists for the PFA
+    init_pfa_list(regions, nregions);
+    esp_printf(putc, "PFA: %d regions, %d of %d frames free\n", nregions, pfa_free_frames(), pfa_total_frames());
+
+    // Set up the kmalloc size classes on top of the PFA
+    kmalloc_init();
+
+    // Sector buffers for the filesystem come out of kmalloc
+    if (bcache_init() != 0) {
+        esp_printf(putc, "Block cache: out of memory, running with fewer buffers\n");
+    }
     
     // Allocate 2 physical pages to the allocd list
     //allocd_list = allocate_physical_pages(2);
     //esp_printf(putc, "next=%x | prev=%x", allocd_list->next, allocd_list->prev);
     
     
-    // Clear the paging datastructures before identity mapping
-    
+    // Clear the kernel page directory. The boot stub's temporary one is
+    // still loaded while we build this.
     for (int i = 0; i < 1024; i++) {
         ((uint32_t*)pd)[i] = 0;
-        ((uint32_t*)pt)[i] = 0;
     }
-    // Link pd[0] to pt
-    pd[0].frame = ((uintptr_t)pt) >> 12;
-    pd[0].present = 1;
-    pd[0].rw = 1;
-    pd[0].user = 0;
-    pd[0].pagesize = 0; 
+
+    // Point the last slot back at the directory so map.c can reach the page
+    // tables it allocates once paging is on
+    pd[PD_SELF_INDEX].frame = V2P(pd) >> 12;
+    pd[PD_SELF_INDEX].present = 1;
+    pd[PD_SELF_INDEX].rw = 1;
+    pd[PD_SELF_INDEX].user = 0;
     
 
-    struct ppage tmp;
-    tmp.next = NULL;
-    tmp.prev = NULL;
-   
+    // Use 4 MiB pages for the big ranges if the CPU can do it
+    if (enablePSE()) {
+        esp_printf(putc, "PSE enabled, using 4 MiB pages\n");
+    }
+
+    // Kernel mappings are the same in every address space, so mark them
+    // global and they stay in the TLB across CR3 reloads
+    uint32_t kernel_flags = PAGE_RW;
+    if (enablePGE()) {
+        kernel_flags |= PAGE_GLOBAL;
+        esp_printf(putc, "PGE enabled, kernel pages are global\n");
+    }
+
     esp_printf(putc, "End of kernel value = %x\n", (uintptr_t)&_end_kernel);
-    // Identity map the kernel
-    for (uintptr_t addr = 0x100000; addr < (uintptr_t)&_end_kernel; addr += 0x1000) {
-        tmp.physical_addr = (void *)addr;
+    // Map the low 4 MiB (BIOS area, video buffer, kernel image) along with
+    // the PFA's frame metadata, rounded out to whole large pages
+    uint32_t low_len = (pfa_reserved_end() + 0x3FFFFF) & ~0x3FFFFF;
+    map_range(P2V(0), 0, low_len, kernel_flags, pd);
 
-        // Call map pages map the virtual and physical addresses
-        map_pages((void *)addr, &tmp, pd);
+    // Map all usable RAM into the kernel half so every frame the PFA hands
+    // out can be touched directly
+    for (int i = 0; i < nregions; i++) {
+        map_range(P2V(regions[i].start), regions[i].start, regions[i].end - regions[i].start, kernel_flags, pd);
     }
    
     esp_printf(putc, "Start of stack=%x | End of stack=%x\n", (uintptr_t)&_start_stack, (uintptr_t)&_end_stack); 
-    // Identity map the stack
-    for (uintptr_t addr = (uintptr_t) &_start_stack; addr < (uintptr_t)&_end_stack; addr += 0x1000) {
-        tmp.physical_addr = (void *)addr;
 
-        // Call map pages map the virtual and physical addresses
-        map_pages((void *)addr, &tmp, pd);
-    }
-    
-    // Map the *current* stack page(s), not just the linker range
-    uint32_t esp_now;
-    __asm__ volatile("mov %%esp,%0" : "=r"(esp_now));
-    tmp.physical_addr = (void *)esp_now;
-    map_pages((void *)esp_now, &tmp, pd);
+    // Load our GDT and IDT so page faults reach page_fault_handler()
+    load_gdt();
+    init_idt();
 
+    // Switch to the real page directory. Paging is already on from the boot
+    // stub; this drops its identity mapping of the low 4 MiB.
+    loadPageDirectory(pd);
 
-    // Identity map the video buffer
-    tmp.physical_addr = (void *)0xB8000;
-    map_pages((void *)0xB8000, &tmp, pd);
+    // Start the timer tick, which drives the filesystem's periodic write back
+    remap_pic();
+    init_pit(PIT_HZ);
+    IRQ_clear_mask(0);
+    asm("sti");
 
-    // lets load the page directory
-    loadPageDirectory(pd);
+    // Disk transfers sleep on IRQ14 from here on instead of polling
+    ata_init();
+    blk_init();
+    if (ata_drive.identified)
+        esp_printf(putc, "Disk: %s, %d MiB, LBA%d, %d sectors per DRQ block\n", ata_drive.model,
+                   ata_drive.sectors / 2048, ata_drive.lba48 ? 48 : 28, ata_drive.multiple ? ata_drive.multiple : 1);
 
-    // Now that everything is identity mapped, lets enable paging
-    enablePaging();
+    // Reserve a demand-zero region and touch one page of it. Only that page
+    // gets a frame.
+    if (vm_reserve(&kernel_as, (void *)0x80000000, 16 * 1024 * 1024, PAGE_RW) == 0) {
+        uint32_t *lazy = (uint32_t *)0x80001000;
+        lazy[0] = 0x1738;
+        esp_printf(putc, "Demand paging: %d faults, %d resolved, last value %x\n",
+                   vm_fault_stats.faults, vm_fault_stats.resolved, lazy[0]);
+    }
 
     esp_printf(putc, "\n\n\n");
     
@@ -236,23 +329,56 @@ void main() {
     if (error != 0) {
         esp_printf(putc, "There was an error with the fat filesystem. Sorry!\n");
     } else {
-        esp_printf(putc, "The fat filesystem initialized successfully\n");
+        esp_printf(putc, "The fat filesystem initialized successfully (FAT%d)\n", fat_type);
     }
 
-    struct file *f = fatOpen("testfile.txt");
-    if (f == NULL) {
-        esp_printf(putc, "File not found!\n");
-    }else {
-        esp_printf(putc, "Successfully opened %s, cluster=%x, size=%x bytes\n", f->rde.file_name, f->start_cluster, f->rde.file_size);
-        esp_printf(putc, "Will now attempt to read that opened file\n");
+    // Nothing below makes sense without a mounted filesystem
+    if (error == 0) {
+        struct file *f = fatOpen("testfile.txt");
+        if (f == NULL) {
+            esp_printf(putc, "File not found!\n");
+        }else {
+            esp_printf(putc, "Successfully opened %s, cluster=%x, size=%x bytes\n", f->rde.file_name, f->start_cluster, f->rde.file_size);
+            esp_printf(putc, "Will now attempt to read that opened file\n");
         
-        uint8_t buffer[512];
-        int bytes = fatRead(f, buffer, sizeof(buffer));
-        buffer[bytes < sizeof(buffer) ? bytes : sizeof(buffer) - 1] = '\0';
-        esp_printf(putc, "Read %d bytes, they're displayed below:\n%s\n", bytes, buffer);
+            const int bufsize = 512;
+            uint8_t *buffer = kmalloc(bufsize);
+            int bytes = fatRead(f, buffer, bufsize);
+            buffer[bytes < bufsize ? bytes : bufsize - 1] = '\0';
+            esp_printf(putc, "Read %d bytes, they're displayed below:\n%s\n", bytes, buffer);
+            kfree(buffer);
+            fatClose(f);
+        }
+        fatSync();
+    }
+    esp_printf(putc, "Block cache: %d hits, %d misses, %d evictions, %d writebacks\n",
+               bcache_stats.hits, bcache_stats.misses, bcache_stats.evictions, bcache_stats.writebacks);
+    esp_printf(putc, "Readahead: %d sectors, %d hits, %d wasted\n",
+               bcache_stats.ra_sectors, bcache_stats.ra_hits, bcache_stats.ra_wasted);
+    esp_printf(putc, "Disk: %d commands, %d by DMA, %d LBA48, %d flushes, %d IRQs, %d timeouts\n",
+               ata_stats.commands, ata_stats.dma, ata_stats.lba48, ata_stats.flushes, ata_stats.irqs,
+               ata_stats.timeouts);
+    if (blk_stats.requests > 0)
+        esp_printf(putc, "Block queue: %d requests in %d commands, %d merged, depth %d max %d avg, latency %d max %d avg ticks\n",
+                   blk_stats.requests, blk_stats.commands, blk_stats.merges, blk_stats.max_depth,
+                   blk_stats.depth_total / blk_stats.requests, blk_stats.latency_max,
+                   blk_stats.completed ? blk_stats.latency_total / blk_stats.completed : 0);
+    esp_printf(putc, "Dentry cache: %d hits, %d negative hits, %d misses\n",
+               dcache_stats.hits, dcache_stats.negative_hits, dcache_stats.misses);
+
+    struct fat_frag_report frag;
+    if (error == 0 && fatFragReport(&frag, NULL) == 0) {
+        esp_printf(putc, "Fragmentation: %d of %d files in pieces, %d pieces for %d clusters\n",
+                   frag.fragmented, frag.files, frag.fragments, frag.clusters);
+        esp_printf(putc, "Free space: %d clusters in %d runs, largest %d\n",
+                   frag.free_clusters, frag.free_runs, frag.largest_free_run);
     }
 
     while(1) {
+        // Flush anything the filesystem has been holding back for a while
+        if (error == 0)
+            fatWriteback(pit_ticks);
+
         // Get the status from PS/2 register
         uint8_t status = inb(0x64);
         // If the LSB is 1 print out the scancode and the keyboard equivalent value 
@@ -0,0 +1,175 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "kmalloc.h"
+#include "page.h"
+
+#define SLAB_MAGIC 0x51AB51AB
+#define SLAB_PAGES (KMALLOC_SLAB_SIZE / PAGE_SIZE)
+
+// Header size is rounded up so the first object starts on a cache line
+#define SLAB_HEADER_SIZE ((sizeof(struct slab) + KMALLOC_ALIGN - 1) & ~(KMALLOC_ALIGN - 1))
+
+/*
+ * Every slab, and every large allocation, starts with this header and is
+ * aligned to KMALLOC_SLAB_SIZE, so kfree() finds it by masking the pointer.
+ *
+ */
+struct slab {
+    uint32_t magic;
+    struct kmem_cache *cache;   // NULL for large allocations
+    struct slab *next;
+    struct slab *prev;
+    void *free;                 // Singly linked list of free objects
+    uint16_t inuse;
+    uint16_t total;
+    struct ppage *pages;        // Frames backing this slab
+    uint32_t npages;
+};
+
+struct kmem_cache kmalloc_caches[KMALLOC_MAX_CACHES];
+int kmalloc_num_caches = 0;
+uint32_t kmalloc_large_pages = 0;
+
+static inline struct slab *slab_of(void *ptr) {
+    return (struct slab *)((uintptr_t)ptr & ~(uintptr_t)(KMALLOC_SLAB_SIZE - 1));
+}
+
+// Grab frames from the PFA and address them through the kernel's linear
+// mapping of physical memory.
+static struct slab *slab_pages(unsigned int npages) {
+    struct ppage *pages = allocate_contiguous_pages(npages);
+    if (pages == NULL) return NULL;
+
+    struct slab *s = (struct slab *)P2V(pages->physical_addr);
+    s->magic = SLAB_MAGIC;
+    s->cache = NULL;
+    s->next = NULL;
+    s->prev = NULL;
+    s->free = NULL;
+    s->inuse = 0;
+    s->total = 0;
+    s->pages = pages;
+    s->npages = npages;
+    return s;
+}
+
+static void partial_push(struct kmem_cache *c, struct slab *s) {
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial) c->partial->prev = s;
+    c->partial = s;
+}
+
+static void partial_remove(struct kmem_cache *c, struct slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else c->partial = s->next;
+    if (s->next) s->next->prev = s->prev;
+    s->next = NULL;
+    s->prev = NULL;
+}
+
+static struct slab *cache_grow(struct kmem_cache *c) {
+    struct slab *s = slab_pages(SLAB_PAGES);
+    if (s == NULL) return NULL;
+
+    s->cache = c;
+    s->total = c->objs_per_slab;
+
+    // Thread the free list through the objects, lowest address first
+    uint8_t *obj = (uint8_t *)s + SLAB_HEADER_SIZE;
+    for (uint32_t i = 0; i < c->objs_per_slab; i++) {
+        *(void **)obj = (i + 1 < c->objs_per_slab) ? obj + c->size : NULL;
+        obj += c->size;
+    }
+    s->free = (uint8_t *)s + SLAB_HEADER_SIZE;
+
+    partial_push(c, s);
+    c->slabs++;
+    return s;
+}
+
+void kmalloc_init(void) {
+    // Size classes double from one cache line up to an eighth of a slab, so
+    // every cache gets at least a handful of objects per slab.
+    kmalloc_num_caches = 0;
+    for (uint32_t size = KMALLOC_MIN_SIZE;
+         size <= KMALLOC_SLAB_SIZE / 8 && kmalloc_num_caches < KMALLOC_MAX_CACHES;
+         size <<= 1) {
+        struct kmem_cache *c = &kmalloc_caches[kmalloc_num_caches++];
+        c->size = size;
+        c->objs_per_slab = (KMALLOC_SLAB_SIZE - SLAB_HEADER_SIZE) / size;
+        c->partial = NULL;
+        c->allocs = 0;
+        c->frees = 0;
+        c->in_use = 0;
+        c->slabs = 0;
+    }
+    kmalloc_large_pages = 0;
+}
+
+void *kmalloc(unsigned int size) {
+    if (size == 0) return NULL;
+
+    // Pick the smallest cache that fits
+    for (int i = 0; i < kmalloc_num_caches; i++) {
+        struct kmem_cache *c = &kmalloc_caches[i];
+        if (size > c->size) continue;
+
+        struct slab *s = c->partial;
+        if (s == NULL) {
+            s = cache_grow(c);
+            if (s == NULL) return NULL;
+        }
+
+        void *obj = s->free;
+        s->free = *(void **)obj;
+        s->inuse++;
+        if (s->free == NULL) partial_remove(c, s);
+
+        c->allocs++;
+        c->in_use++;
+        return obj;
+    }
+
+    // Too big for any cache, take whole frames. Rounding up to a full slab
+    // keeps the block aligned so kfree() can still find the header.
+    unsigned int npages = (size + SLAB_HEADER_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (npages < SLAB_PAGES) npages = SLAB_PAGES;
+
+    struct slab *s = slab_pages(npages);
+    if (s == NULL) return NULL;
+    kmalloc_large_pages += npages;
+    return (uint8_t *)s + SLAB_HEADER_SIZE;
+}
+
+void kfree(void *ptr) {
+    if (ptr == NULL) return;
+
+    struct slab *s = slab_of(ptr);
+    if (s->magic != SLAB_MAGIC) return;
+
+    struct kmem_cache *c = s->cache;
+    if (c == NULL) {
+        kmalloc_large_pages -= s->npages;
+        s->magic = 0;
+        free_physical_pages(s->pages);
+        return;
+    }
+
+    // A full slab goes back on the partial list once it has room again
+    if (s->free == NULL) partial_push(c, s);
+    *(void **)ptr = s->free;
+    s->free = ptr;
+    s->inuse--;
+    c->frees++;
+    c->in_use--;
+
+    // Release empty slabs, but keep one around so a cache that keeps
+    // allocating and freeing a single object doesn't thrash the PFA.
+    if (s->inuse == 0 && (s->prev != NULL || s->next != NULL)) {
+        partial_remove(c, s);
+        c->slabs--;
+        s->magic = 0;
+        free_physical_pages(s->pages);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef __KMALLOC_H__
+#define __KMALLOC_H__
+
+#include <stdint.h>
+
+#ifndef CONFIG_HEAP_SIZE
+#define CONFIG_HEAP_SIZE 4096
+#endif
+
+#define KMALLOC_SLAB_SIZE CONFIG_HEAP_SIZE   // Bytes per slab, must be a power of two pages
+#define KMALLOC_ALIGN 64                     // Cache line size, every object starts on one
+#define KMALLOC_MIN_SIZE 64
+#define KMALLOC_MAX_CACHES 16
+
+struct slab;
+
+/*
+ * One cache per size class. Objects are handed out from the slabs on the
+ * partial list; full slabs are off the list until something is freed.
+ *
+ */
+struct kmem_cache {
+    uint32_t size;            // Object size, a multiple of KMALLOC_ALIGN
+    uint32_t objs_per_slab;
+    struct slab *partial;     // Slabs with at least one free object
+
+    // Usage counters
+    uint32_t allocs;
+    uint32_t frees;
+    uint32_t in_use;          // Objects currently allocated
+    uint32_t slabs;           // Slabs currently owned by this cache
+};
+
+extern struct kmem_cache kmalloc_caches[KMALLOC_MAX_CACHES];
+extern int kmalloc_num_caches;
+extern uint32_t kmalloc_large_pages;   // Frames held by allocations too big for a cache
+
+void kmalloc_init(void);
+void *kmalloc(unsigned int size);
+void kfree(void *ptr);
+
+#endif
@@ -4,8 +4,187 @@
 #include "page.h"
 
 struct page_directory_entry pd[1024] __attribute__((aligned(4096)));
-struct page pt[1024] __attribute__((aligned(4096)));
 
+// Set once CR4.PSE is on and map_range() may use 4 MiB pages
+static int pse_enabled = 0;
+
+// Set once CR4.PGE is on, so a CR3 reload no longer drops global pages
+static int pge_enabled = 0;
+
+struct tlb_stats tlb_stats;
+
+/*
+ * Pages whose translations changed during one mapping call. They are only
+ * invalidated once the call is done, and if more than TLB_FLUSH_THRESHOLD
+ * pile up it's cheaper to just reload CR3.
+ *
+ */
+struct tlb_batch {
+    uint32_t count;
+    int kernel;          // Something in the (global) kernel half changed
+    uintptr_t addrs[TLB_FLUSH_THRESHOLD];
+};
+
+static int paging_enabled(void) {
+    uint32_t cr0;
+    asm volatile("mov %%cr0,%0" : "=r"(cr0));
+    return (cr0 >> 31) & 1;
+}
+
+static int is_active_directory(struct page_directory_entry *pd) {
+    uint32_t cr3;
+    asm volatile("mov %%cr3,%0" : "=r"(cr3));
+    return (cr3 & ~0xFFF) == V2P(pd);
+}
+
+void tlb_flush_page(void *vaddr) {
+    asm volatile("invlpg (%0)" : : "r"(vaddr) : "memory");
+    tlb_stats.invlpg++;
+}
+
+// Reload CR3. Global kernel pages survive that, so when global is set
+// CR4.PGE is toggled as well, which flushes everything.
+void tlb_flush_all(int global) {
+    if (global && pge_enabled) {
+        uint32_t cr4;
+        asm volatile("mov %%cr4,%0\n"
+                     "and $~0x80,%0\n"
+                     "mov %0,%%cr4\n"
+                     "or $0x80,%0\n"
+                     "mov %0,%%cr4" : "=&r"(cr4) : : "memory");
+        tlb_stats.global_flushes++;
+        return;
+    }
+
+    uint32_t cr3;
+    asm volatile("mov %%cr3,%0\n"
+                 "mov %0,%%cr3" : "=r"(cr3) : : "memory");
+    tlb_stats.full_flushes++;
+}
+
+static void tlb_batch_add(struct tlb_batch *batch, uintptr_t virt) {
+    if (batch->count < TLB_FLUSH_THRESHOLD) {
+        batch->addrs[batch->count] = virt;
+    }
+    if (virt >= KERNEL_VIRT_BASE) batch->kernel = 1;
+    batch->count++;
+}
+
+// Invalidate everything collected in batch. Changes to a directory that
+// isn't loaded can't be in the TLB, so there's nothing to do for those.
+static void tlb_batch_finish(struct tlb_batch *batch, struct page_directory_entry *pd) {
+    if (batch->count == 0 || !paging_enabled() || !is_active_directory(pd)) return;
+
+    tlb_stats.batches++;
+    if (batch->count > TLB_FLUSH_THRESHOLD) {
+        tlb_flush_all(batch->kernel);
+        return;
+    }
+    for (uint32_t i = 0; i < batch->count; i++) {
+        tlb_flush_page((void *)batch->addrs[i]);
+    }
+}
+
+// Get a pointer we can use to touch the page table behind pd[page_dir_index].
+// For the loaded directory that's the self-map window; otherwise the table
+// is reached through the kernel's linear mapping of physical memory.
+static struct page *page_table_of(struct page_directory_entry *pd, uint32_t page_dir_index) {
+    if (paging_enabled() && is_active_directory(pd)) {
+        return (struct page *)(PT_WINDOW + page_dir_index * 0x1000);
+    }
+    return (struct page *)P2V(pd[page_dir_index].frame << 12);
+}
+
+// Find the page table covering page_dir_index, allocating a zeroed one from
+// the PFA if the slot is empty. Returns NULL if we're out of frames.
+static struct page *get_page_table(struct page_directory_entry *pd, uint32_t page_dir_index, uint32_t flags) {
+    // Already covered by a 4 MiB page, there's no table to hand out
+    if (pd[page_dir_index].present && pd[page_dir_index].pagesize) return NULL;
+
+    if (!pd[page_dir_index].present) {
+        struct ppage *frame = allocate_physical_pages(1);
+        if (frame == NULL) return NULL;
+
+        ((uint32_t *)pd)[page_dir_index] = 0;
+        pd[page_dir_index].frame   = (uintptr_t)frame->physical_addr >> 12;
+        pd[page_dir_index].present = 1;
+        pd[page_dir_index].rw      = 1;
+
+        struct page *table = page_table_of(pd, page_dir_index);
+        for (int i = 0; i < 1024; i++) {
+            ((uint32_t *)table)[i] = 0;
+        }
+    }
+
+    // The directory entry has to allow user access for any page under it to
+    if (flags & PAGE_USER) pd[page_dir_index].user = 1;
+
+    return page_table_of(pd, page_dir_index);
+}
+
+// Hand the page table behind pd[page_dir_index] back to the PFA if nothing
+// in it is mapped anymore.
+static void release_if_empty(struct page_directory_entry *pd, uint32_t page_dir_index, struct tlb_batch *batch) {
+    if (!pd[page_dir_index].present || pd[page_dir_index].pagesize) return;
+
+    struct page *table = page_table_of(pd, page_dir_index);
+    for (int i = 0; i < 1024; i++) {
+        if (table[i].present) return;
+    }
+
+    struct ppage *frame = pfa_page_of(pd[page_dir_index].frame << 12);
+    if (frame == NULL) return;
+
+    ((uint32_t *)pd)[page_dir_index] = 0;
+    free_physical_pages(frame);
+
+    // The table's slot in the window goes away with it
+    tlb_batch_add(batch, PT_WINDOW + page_dir_index * 0x1000);
+}
+
+// Break a 4 MiB page into a page table of 1024 small pages with the same
+// frames and permissions, so part of it can be unmapped or reprotected.
+static int split_large_page(struct page_directory_entry *pd, uint32_t page_dir_index, struct tlb_batch *batch) {
+    struct ppage *frame = allocate_physical_pages(1);
+    if (frame == NULL) return -1;
+
+    struct page_directory_entry large = pd[page_dir_index];
+
+    // Fill the table before linking it so the range never goes unmapped
+    struct page *table = (struct page *)P2V(frame->physical_addr);
+    for (uint32_t i = 0; i < 1024; i++) {
+        ((uint32_t *)table)[i] = 0;
+        table[i].frame   = large.frame + i;
+        table[i].present = 1;
+        table[i].rw      = large.rw;
+        table[i].user    = large.user;
+        table[i].global  = large.global;
+    }
+
+    ((uint32_t *)pd)[page_dir_index] = 0;
+    pd[page_dir_index].frame   = (uintptr_t)frame->physical_addr >> 12;
+    pd[page_dir_index].present = 1;
+    pd[page_dir_index].rw      = 1;
+    pd[page_dir_index].user    = large.user;
+
+    // The window slot may still translate to the large page, and we're
+    // about to write the new table through it, so that one can't wait.
+    // The large page itself just goes on the batch.
+    if (paging_enabled() && is_active_directory(pd)) {
+        tlb_flush_page((void *)(PT_WINDOW + page_dir_index * 0x1000));
+    }
+    tlb_batch_add(batch, (uintptr_t)page_dir_index << 22);
+    return 0;
+}
+
+// Whether the 4 MiB page at pde already maps virt to phys with flags, so
+// there's nothing to change
+static int large_page_matches(struct page_directory_entry *pde, uintptr_t virt, uintptr_t phys, uint32_t flags) {
+    return ((uintptr_t)pde->frame << 12) + (virt & 0x3FFFFF) == phys &&
+           pde->rw == ((flags & PAGE_RW) ? 1 : 0) &&
+           pde->user == ((flags & PAGE_USER) ? 1 : 0) &&
+           pde->global == ((flags & PAGE_GLOBAL) ? 1 : 0);
+}
 
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd) {
     // Keep the original base to return
@@ -13,6 +192,7 @@ void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *
 
     // Convert input address to int so that arithmetic doens't get messed up
     uintptr_t virt = (uintptr_t)vaddr;
+    struct tlb_batch batch = { .count = 0 };
 
     struct ppage *cursor = pglist;
     while (cursor != NULL) {
@@ -22,38 +202,256 @@ void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *
         const uint32_t page_dir_index = (vpn >> 10) & 0x3FF;
         const uint32_t page_table_index = vpn & 0x3FF;
 
-        // Check that page_dir_index is 0 we only have the one page table
-        if(page_dir_index == 0) {
-
-            // Use our single page table
-            struct page *const page_table_base = pt;
+        // The top 4 MiB is where the page tables themselves show up
+        if (page_dir_index == PD_SELF_INDEX) {
+            tlb_batch_finish(&batch, pd);
+            return NULL;
+        }
 
-            // Fill one 4KB from the current physical page
-            const uintptr_t phys = (uintptr_t)cursor->physical_addr;
+        const uintptr_t phys = (uintptr_t)cursor->physical_addr;
 
-            if (!page_table_base[page_table_index].present) {
-                page_table_base[page_table_index].frame   = (uint32_t)(phys >> 12);
-                page_table_base[page_table_index].present = 1;
-                page_table_base[page_table_index].rw      = 1;
-                page_table_base[page_table_index].user    = 0;
+        // Under a 4 MiB page. Nothing to do if it maps this frame already,
+        // otherwise it's split so the frame can go in.
+        if (pd[page_dir_index].present && pd[page_dir_index].pagesize) {
+            if (large_page_matches(&pd[page_dir_index], virt, phys, PAGE_RW)) {
+                virt   += 0x1000;
+                cursor  = cursor->next;
+                continue;
             }
+            if (split_large_page(pd, page_dir_index, &batch) != 0) {
+                tlb_batch_finish(&batch, pd);
+                return NULL;
+            }
+        }
 
-            // Advance one 4KB page virtually and advance the physical list
-            virt   += 0x1000;
-            cursor  = cursor->next;
+        struct page *const page_table_base = get_page_table(pd, page_dir_index, PAGE_RW);
+        if (page_table_base == NULL) {
+            tlb_batch_finish(&batch, pd);
+            return NULL;
         }
+
+        // Fill one 4KB from the current physical page, replacing whatever
+        // else was there
+        if (!page_table_base[page_table_index].present ||
+            page_table_base[page_table_index].frame != (uint32_t)(phys >> 12)) {
+            if (page_table_base[page_table_index].present) tlb_batch_add(&batch, virt);
+            ((uint32_t *)page_table_base)[page_table_index] = 0;
+            page_table_base[page_table_index].frame   = (uint32_t)(phys >> 12);
+            page_table_base[page_table_index].present = 1;
+            page_table_base[page_table_index].rw      = 1;
+            page_table_base[page_table_index].user    = 0;
+        }
+
+        // Advance one 4KB page virtually and advance the physical list
+        virt   += 0x1000;
+        cursor  = cursor->next;
     }
 
+    tlb_batch_finish(&batch, pd);
     return vaddr_base;
 }
 
+// Map len bytes of physical memory at paddr to vaddr. Wherever both sides
+// line up on a 4 MiB boundary and the directory slot is free a single large
+// page is used, and 4 KiB pages fill in the edges.
+void *map_range(void *vaddr, uintptr_t paddr, uint32_t len, uint32_t flags, struct page_directory_entry *pd) {
+    uintptr_t virt = (uintptr_t)vaddr & ~0xFFF;
+    uintptr_t phys = paddr & ~0xFFF;
+    uint32_t npages = (len + ((uintptr_t)vaddr & 0xFFF) + 0xFFF) >> 12;
+    struct tlb_batch batch = { .count = 0 };
+
+    while (npages > 0) {
+        const uint32_t vpn = (uint32_t)(virt >> 12);
+        const uint32_t page_dir_index = (vpn >> 10) & 0x3FF;
+        const uint32_t page_table_index = vpn & 0x3FF;
+
+        if (page_dir_index == PD_SELF_INDEX) {
+            tlb_batch_finish(&batch, pd);
+            return NULL;
+        }
+
+        if (pse_enabled && page_table_index == 0 && (phys & 0x3FFFFF) == 0 &&
+            npages >= 1024 && !pd[page_dir_index].present) {
+            ((uint32_t *)pd)[page_dir_index] = 0;
+            pd[page_dir_index].frame    = (uint32_t)(phys >> 12);
+            pd[page_dir_index].present  = 1;
+            pd[page_dir_index].rw       = (flags & PAGE_RW) ? 1 : 0;
+            pd[page_dir_index].user     = (flags & PAGE_USER) ? 1 : 0;
+            pd[page_dir_index].global   = (flags & PAGE_GLOBAL) ? 1 : 0;
+            pd[page_dir_index].pagesize = 1;
+
+            virt   += 0x400000;
+            phys   += 0x400000;
+            npages -= 1024;
+            continue;
+        }
+
+        // An existing 4 MiB page that already maps the rest of this slot
+        // the same way is left alone. Anything else is split and the
+        // pages we were asked for go in over it.
+        if (pd[page_dir_index].present && pd[page_dir_index].pagesize) {
+            if (large_page_matches(&pd[page_dir_index], virt, phys, flags)) {
+                uint32_t span = 1024 - page_table_index;
+                if (span > npages) span = npages;
+                virt   += span * 0x1000;
+                phys   += span * 0x1000;
+                npages -= span;
+                continue;
+            }
+            if (split_large_page(pd, page_dir_index, &batch) != 0) {
+                tlb_batch_finish(&batch, pd);
+                return NULL;
+            }
+        }
+
+        struct page *table = get_page_table(pd, page_dir_index, flags);
+        if (table == NULL) {
+            tlb_batch_finish(&batch, pd);
+            return NULL;
+        }
+
+        // Only a translation that was present can be sitting in the TLB
+        if (table[page_table_index].present) tlb_batch_add(&batch, virt);
+
+        ((uint32_t *)table)[page_table_index] = 0;
+        table[page_table_index].frame   = (uint32_t)(phys >> 12);
+        table[page_table_index].present = 1;
+        table[page_table_index].rw      = (flags & PAGE_RW) ? 1 : 0;
+        table[page_table_index].user    = (flags & PAGE_USER) ? 1 : 0;
+        table[page_table_index].global  = (flags & PAGE_GLOBAL) ? 1 : 0;
+
+        virt   += 0x1000;
+        phys   += 0x1000;
+        npages--;
+    }
+
+    tlb_batch_finish(&batch, pd);
+    return vaddr;
+}
+
+// Remove npages mappings starting at vaddr. The frames themselves belong to
+// the caller; page tables left with nothing in them go back to the PFA.
+void unmap_pages(void *vaddr, unsigned int npages, struct page_directory_entry *pd) {
+    uintptr_t virt = (uintptr_t)vaddr & ~0xFFF;
+    struct tlb_batch batch = { .count = 0 };
+
+    while (npages > 0) {
+        const uint32_t vpn = (uint32_t)(virt >> 12);
+        const uint32_t page_dir_index = (vpn >> 10) & 0x3FF;
+        uint32_t page_table_index = vpn & 0x3FF;
+
+        // Pages left in this page table
+        uint32_t span = 1024 - page_table_index;
+        if (span > npages) span = npages;
+
+        if (pd[page_dir_index].present && page_dir_index != PD_SELF_INDEX) {
+            if (pd[page_dir_index].pagesize) {
+                // Dropping the whole 4 MiB page is just clearing the entry
+                if (span == 1024) {
+                    ((uint32_t *)pd)[page_dir_index] = 0;
+                    tlb_batch_add(&batch, virt);
+                    tlb_batch_add(&batch, PT_WINDOW + page_dir_index * 0x1000);
+                    virt   += span * 0x1000;
+                    npages -= span;
+                    continue;
+                }
+                if (split_large_page(pd, page_dir_index, &batch) != 0) break;
+            }
+
+            struct page *table = page_table_of(pd, page_dir_index);
+            for (uint32_t i = 0; i < span; i++, page_table_index++) {
+                if (!table[page_table_index].present) continue;
+                ((uint32_t *)table)[page_table_index] = 0;
+                tlb_batch_add(&batch, virt + i * 0x1000);
+            }
+            release_if_empty(pd, page_dir_index, &batch);
+        }
+
+        virt   += span * 0x1000;
+        npages -= span;
+    }
+
+    tlb_batch_finish(&batch, pd);
+}
+
+// Change the PAGE_RW/PAGE_USER bits on npages existing mappings
+void protect_pages(void *vaddr, unsigned int npages, uint32_t flags, struct page_directory_entry *pd) {
+    uintptr_t virt = (uintptr_t)vaddr & ~0xFFF;
+    struct tlb_batch batch = { .count = 0 };
+
+    while (npages > 0) {
+        const uint32_t vpn = (uint32_t)(virt >> 12);
+        const uint32_t page_dir_index = (vpn >> 10) & 0x3FF;
+        uint32_t page_table_index = vpn & 0x3FF;
+
+        uint32_t span = 1024 - page_table_index;
+        if (span > npages) span = npages;
+
+        if (pd[page_dir_index].present && page_dir_index != PD_SELF_INDEX) {
+            if (pd[page_dir_index].pagesize) {
+                if (span == 1024) {
+                    pd[page_dir_index].rw   = (flags & PAGE_RW) ? 1 : 0;
+                    pd[page_dir_index].user = (flags & PAGE_USER) ? 1 : 0;
+                    tlb_batch_add(&batch, virt);
+                    virt   += span * 0x1000;
+                    npages -= span;
+                    continue;
+                }
+                if (split_large_page(pd, page_dir_index, &batch) != 0) break;
+            }
+            if (flags & PAGE_USER) pd[page_dir_index].user = 1;
+
+            struct page *table = page_table_of(pd, page_dir_index);
+            for (uint32_t i = 0; i < span; i++, page_table_index++) {
+                if (!table[page_table_index].present) continue;
+                table[page_table_index].rw   = (flags & PAGE_RW) ? 1 : 0;
+                table[page_table_index].user = (flags & PAGE_USER) ? 1 : 0;
+                tlb_batch_add(&batch, virt + i * 0x1000);
+            }
+        }
+
+        virt   += span * 0x1000;
+        npages -= span;
+    }
+
+    tlb_batch_finish(&batch, pd);
+}
+
 void loadPageDirectory(struct page_directory_entry *pd) {
     asm("mov %0,%%cr3"
         :
-        : "r"(pd)
+        : "r"(V2P(pd))
         :);
 }
 
+// Turn on 4 MiB pages (CR4.PSE) if CPUID says the CPU has them. Returns 1
+// if map_range() can use large pages from now on.
+int enablePSE(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 3))) return 0;
+
+    asm volatile("mov %%cr4, %%eax\n"
+                 "or $0x10, %%eax\n"
+                 "mov %%eax, %%cr4" : : : "eax");
+    pse_enabled = 1;
+    return 1;
+}
+
+// Turn on global pages (CR4.PGE) if CPUID says the CPU has them. Returns 1
+// if PAGE_GLOBAL mappings will now survive CR3 reloads.
+int enablePGE(void) {
+    uint32_t eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    if (!(edx & (1 << 13))) return 0;
+
+    asm volatile("mov %%cr4, %%eax\n"
+                 "or $0x80, %%eax\n"
+                 "mov %%eax, %%cr4" : : : "eax");
+    pge_enabled = 1;
+    return 1;
+}
+
 void enablePaging(void) {
     // Enable Paging
     asm("mov %cr0, %eax\n"
@@ -11,9 +11,10 @@ struct page_directory_entry
    uint32_t user          : 1;   // Supervisor only if clear
    uint32_t writethru     : 1;   // Cache this directory as write-thru only
    uint32_t cachedisabled : 1;   // Disable cache on this page table?
-   uint32_t accessed      : 1;   // Supervisor level only if clear
-   uint32_t pagesize      : 1;   // Has the page been accessed since last refresh?
-   uint32_t ignored       : 2;   // Has the page been written to since last refresh?
+   uint32_t accessed      : 1;   // Has the page been accessed since last refresh?
+   uint32_t dirty         : 1;   // Has the page been written to? (4 MiB pages only)
+   uint32_t pagesize      : 1;   // Maps a 4 MiB page instead of pointing at a page table
+   uint32_t global        : 1;   // Survives CR3 reloads when CR4.PGE is on (4 MiB pages only)
    uint32_t os_specific   : 3;   // Amalgamation of unused and reserved bits
    uint32_t frame         : 20;  // Frame address (shifted right 12 bits)
 };
@@ -24,16 +25,48 @@ struct page
    uint32_t present    : 1;   // Page present in memory
    uint32_t rw         : 1;   // Read-only if clear, readwrite if set
    uint32_t user       : 1;   // Supervisor level only if clear
+   uint32_t writethru  : 1;   // Cache this page as write-thru only
+   uint32_t cachedisabled : 1; // Disable cache on this page?
    uint32_t accessed   : 1;   // Has the page been accessed since last refresh?
    uint32_t dirty      : 1;   // Has the page been written to since last refresh?
-   uint32_t unused     : 7;   // Amalgamation of unused and reserved bits
+   uint32_t pat        : 1;   // Page attribute table index
+   uint32_t global     : 1;   // Survives CR3 reloads when CR4.PGE is on
+   uint32_t unused     : 3;   // Amalgamation of unused and reserved bits
    uint32_t frame      : 20;  // Frame address (shifted right 12 bits)
 };
 
+// Mapping flags, same bit positions as the hardware entries
+#define PAGE_PRESENT 0x1
+#define PAGE_RW      0x2
+#define PAGE_USER    0x4
+#define PAGE_GLOBAL  0x100
+
+// The last directory slot points back at the directory itself, which makes
+// every page table of the active directory visible in the top 4 MiB.
+#define PD_SELF_INDEX 1023
+#define PT_WINDOW     0xFFC00000
+
+// Above this many pages in one call, reload CR3 instead of using invlpg
+#define TLB_FLUSH_THRESHOLD 32
+
+struct tlb_stats {
+    uint32_t invlpg;         // Single page invalidations
+    uint32_t full_flushes;   // CR3 reloads
+    uint32_t global_flushes; // CR4.PGE toggles, which drop global pages too
+    uint32_t batches;        // Mapping calls that had something to invalidate
+};
+
+extern struct tlb_stats tlb_stats;
 extern struct page_directory_entry pd[1024];
-extern struct page pt[1024];
 
 void *map_pages(void *vaddr, struct ppage *pglist, struct page_directory_entry *pd);
+void *map_range(void *vaddr, uintptr_t paddr, uint32_t len, uint32_t flags, struct page_directory_entry *pd);
+void unmap_pages(void *vaddr, unsigned int npages, struct page_directory_entry *pd);
+void protect_pages(void *vaddr, unsigned int npages, uint32_t flags, struct page_directory_entry *pd);
+void tlb_flush_page(void *vaddr);
+void tlb_flush_all(int global);
 void loadPageDirectory(struct page_directory_entry *pd);
+int enablePSE(void);
+int enablePGE(void);
 void enablePaging(void);
 #endif
@@ -0,0 +1,52 @@
+#ifndef __MULTIBOOT_H__
+#define __MULTIBOOT_H__
+
+#include <stdint.h>
+
+// Value the bootloader leaves in EAX when it hands us a Multiboot2 info struct
+#define MULTIBOOT2_BOOTLOADER_MAGIC 0x36d76289
+
+#define MULTIBOOT_TAG_TYPE_END           0
+#define MULTIBOOT_TAG_TYPE_BASIC_MEMINFO 4
+#define MULTIBOOT_TAG_TYPE_MMAP          6
+
+#define MULTIBOOT_MEMORY_AVAILABLE 1
+
+/*
+ * The info struct is a fixed header followed by a list of tags, each one
+ * padded out to an 8 byte boundary. The list ends with a tag of type 0.
+ *
+ */
+struct multiboot_info {
+    uint32_t total_size;
+    uint32_t reserved;
+};
+
+struct multiboot_tag {
+    uint32_t type;
+    uint32_t size;
+};
+
+struct multiboot_tag_basic_meminfo {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mem_lower;   // KiB of memory starting at 0
+    uint32_t mem_upper;   // KiB of memory starting at 1 MiB
+};
+
+struct multiboot_mmap_entry {
+    uint64_t addr;
+    uint64_t len;
+    uint32_t type;
+    uint32_t reserved;
+} __attribute__((packed));
+
+struct multiboot_tag_mmap {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+    struct multiboot_mmap_entry entries[0];
+};
+
+#endif
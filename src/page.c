@@ -1,47 +1,291 @@
 #include "page.h"
 #include <stddef.h>
+#include <stdint.h>
 
-struct ppage physical_page_array[128];
-static struct ppage *free_list = NULL;
+extern char _start_kernel;
+extern char _end_kernel;
 
-void init_pfa_list(void) {
-    for (int i = 0; i < 128; i++) {
-        physical_page_array[i].physical_addr = (void *)(i * (2 * 1024 * 1024));
-        physical_page_array[i].next = (i < 127) ? &physical_page_array[i + 1] : NULL;
-        physical_page_array[i].prev = (i > 0)  ? &physical_page_array[i - 1] : NULL;
+/*
+ * Each usable RAM range from the memory map becomes a zone with its own
+ * ppage array, so holes in the physical address space cost nothing. The
+ * arrays are carved out of memory right after the kernel image.
+ *
+ */
+struct pfa_zone {
+    uint32_t base_pfn;
+    uint32_t nframes;
+    struct ppage *pages;
+};
+
+static struct pfa_zone zones[PFA_MAX_ZONES];
+static int nzones = 0;
+
+// One free list per block order. Only the head frame of each free block is
+// linked in, so the lists stay short no matter how much memory we manage.
+static struct ppage *free_area[PFA_MAX_ORDER + 1];
+static unsigned int free_frames = 0;
+static unsigned int total_frames = 0;
+
+// End of the kernel image plus the frame metadata placed after it
+static uintptr_t reserved_end = 0;
+
+static inline uint32_t page_pfn(struct ppage *pg) {
+    return (uint32_t)((uintptr_t)pg->physical_addr >> 12);
+}
+
+static inline struct ppage *pfn_to_page(struct pfa_zone *z, uint32_t pfn) {
+    return &z->pages[pfn - z->base_pfn];
+}
+
+static void free_area_push(struct ppage *pg, unsigned int order) {
+    pg->order = order;
+    pg->flags |= PPAGE_FREE;
+    pg->prev = NULL;
+    pg->next = free_area[order];
+    if (free_area[order]) free_area[order]->prev = pg;
+    free_area[order] = pg;
+}
+
+static void free_area_remove(struct ppage *pg) {
+    if (pg->prev) pg->prev->next = pg->next;
+    else free_area[pg->order] = pg->next;
+    if (pg->next) pg->next->prev = pg->prev;
+    pg->next = NULL;
+    pg->prev = NULL;
+    pg->flags &= ~PPAGE_FREE;
+}
+
+// Return a 2^order block starting at frame pfn, merging it with its buddy
+// for as long as the buddy is also free and the same size.
+static void free_block(struct pfa_zone *z, uint32_t pfn, unsigned int order) {
+    free_frames += 1u << order;
+
+    while (order < PFA_MAX_ORDER) {
+        uint32_t buddy = pfn ^ (1u << order);
+        // Unsigned compare also catches buddies below the start of the zone
+        if (buddy - z->base_pfn >= z->nframes) break;
+
+        struct ppage *b = pfn_to_page(z, buddy);
+        if (!(b->flags & PPAGE_FREE) || b->order != order) break;
+
+        free_area_remove(b);
+        pfn &= ~(1u << order);
+        order++;
+    }
+    free_area_push(pfn_to_page(z, pfn), order);
+}
+
+// Free an arbitrary run of frames by cutting it into the largest aligned
+// power-of-two blocks that fit.
+static void free_range(struct pfa_zone *z, uint32_t pfn, uint32_t count) {
+    while (count > 0) {
+        unsigned int order = 0;
+        while (order < PFA_MAX_ORDER &&
+               (pfn & ((2u << order) - 1)) == 0 &&
+               (2u << order) <= count) {
+            order++;
+        }
+        free_block(z, pfn, order);
+        pfn += 1u << order;
+        count -= 1u << order;
+    }
+}
+
+// Take a 2^order block off the free lists, splitting a larger one if needed.
+// Returns the head frame of the block or NULL if nothing big enough is free.
+static struct ppage *alloc_block(unsigned int order) {
+    unsigned int o = order;
+    while (o <= PFA_MAX_ORDER && free_area[o] == NULL) o++;
+    if (o > PFA_MAX_ORDER) return NULL;
+
+    struct ppage *pg = free_area[o];
+    free_area_remove(pg);
+
+    // Hand the upper halves back until the block is the size we wanted
+    while (o > order) {
+        o--;
+        free_area_push(pg + (1u << o), o);
+    }
+    free_frames -= 1u << order;
+    return pg;
+}
+
+static unsigned int order_for(unsigned int npages) {
+    unsigned int order = 0;
+    while ((1u << order) < npages) order++;
+    return order;
+}
+
+// Give back frames [count, 1 << order) of a block we just allocated
+static void trim_block(struct ppage *pg, unsigned int order, uint32_t count) {
+    if ((1u << order) > count) {
+        free_range(&zones[pg->zone], page_pfn(pg) + count, (1u << order) - count);
     }
-    free_list = &physical_page_array[0];
+}
+
+// Link count frames starting at pg into a list and append it after *tail
+static void link_run(struct ppage *pg, uint32_t count, struct ppage **head, struct ppage **tail) {
+    for (uint32_t i = 0; i < count; i++, pg++) {
+        pg->flags = 0;
+        pg->next = NULL;
+        pg->prev = *tail;
+        if (*tail) (*tail)->next = pg;
+        else *head = pg;
+        *tail = pg;
+    }
+}
+
+void init_pfa_list(struct pfa_region *regions, int nregions) {
+    // Kernel virtual address where the next ppage array goes
+    uintptr_t meta = ((uintptr_t)&_end_kernel + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+    for (int o = 0; o <= PFA_MAX_ORDER; o++) free_area[o] = NULL;
+    free_frames = 0;
+    total_frames = 0;
+    nzones = 0;
+
+    // Whatever follows the kernel must be RAM the memory map lets us use,
+    // so the arrays stay inside the region the kernel was loaded into. If
+    // the kernel isn't in one there's nowhere safe for them at all.
+    uintptr_t meta_end = meta;
+    for (int i = 0; i < nregions; i++) {
+        if (regions[i].start <= V2P(&_start_kernel) && V2P(meta) <= regions[i].end) {
+            meta_end = (uintptr_t)P2V(regions[i].end);
+            break;
+        }
+    }
+
+    // Lay out one ppage array per region right after the kernel
+    for (int i = 0; i < nregions && nzones < PFA_MAX_ZONES; i++) {
+        uint32_t start = (regions[i].start + PAGE_SIZE - 1) / PAGE_SIZE;
+        uint32_t end = regions[i].end / PAGE_SIZE;
+        if (end <= start) continue;
+
+        // Frames we have no room to describe are left out
+        uint32_t room = (meta_end - meta) / sizeof(struct ppage);
+        if (end - start > room) end = start + room;
+        if (end <= start) break;
+
+        struct pfa_zone *z = &zones[nzones];
+        z->base_pfn = start;
+        z->nframes = end - start;
+        z->pages = (struct ppage *)meta;
+        meta += z->nframes * sizeof(struct ppage);
+
+        for (uint32_t f = 0; f < z->nframes; f++) {
+            z->pages[f].physical_addr = (void *)((start + f) * PAGE_SIZE);
+            z->pages[f].next = NULL;
+            z->pages[f].prev = NULL;
+            z->pages[f].order = 0;
+            z->pages[f].flags = 0;
+            z->pages[f].zone = nzones;
+        }
+        total_frames += z->nframes;
+        nzones++;
+    }
+    reserved_end = V2P((meta + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1));
+
+    // Free everything except the kernel image and the arrays we just built
+    uint32_t resv_lo = V2P(&_start_kernel) / PAGE_SIZE;
+    uint32_t resv_hi = reserved_end / PAGE_SIZE;
+    for (int i = 0; i < nzones; i++) {
+        struct pfa_zone *z = &zones[i];
+        uint32_t lo = z->base_pfn;
+        uint32_t hi = z->base_pfn + z->nframes;
+
+        if (hi <= resv_lo || lo >= resv_hi) {
+            free_range(z, lo, hi - lo);
+            continue;
+        }
+        if (lo < resv_lo) free_range(z, lo, resv_lo - lo);
+        if (hi > resv_hi) free_range(z, resv_hi, hi - resv_hi);
+    }
+}
+
+// Allocate npages physically contiguous frames. The frames come back linked
+// through next/prev like allocate_physical_pages(), but physical_addr of each
+// frame is guaranteed to follow the one before it.
+struct ppage *allocate_contiguous_pages(unsigned int npages) {
+    if (npages == 0 || npages > (1u << PFA_MAX_ORDER)) return NULL;
+
+    unsigned int order = order_for(npages);
+    struct ppage *pg = alloc_block(order);
+    if (pg == NULL) return NULL;
+    trim_block(pg, order, npages);
+
+    struct ppage *head = NULL, *tail = NULL;
+    link_run(pg, npages, &head, &tail);
+    return head;
 }
 
 struct ppage *allocate_physical_pages(unsigned int npages) {
-    if (npages == 0 || free_list == NULL) return NULL;
-    unsigned int count = 0;
-    struct ppage *probe = free_list;
-    while (probe && count < npages) {
-        probe = probe->next;
-        count++;
-    }
-    if (count < npages) return NULL;
-    struct ppage *alloc_head = free_list;
-    struct ppage *alloc_tail = alloc_head;
-    for (unsigned int i = 1; i < npages; i++) {
-        alloc_tail = alloc_tail->next;
-    }
-    struct ppage *remainder = alloc_tail->next;
-    if (remainder) remainder->prev = NULL;
-    alloc_tail->next = NULL;
-    alloc_head->prev = NULL;
-    free_list = remainder;
-    return alloc_head;
+    if (npages == 0 || npages > free_frames) return NULL;
+
+    struct ppage *head = allocate_contiguous_pages(npages);
+    if (head) return head;
+
+    // No single block is big enough, so gather the largest blocks available
+    struct ppage *tail = NULL;
+    unsigned int remaining = npages;
+    while (remaining > 0) {
+        unsigned int order = PFA_MAX_ORDER;
+        while (free_area[order] == NULL) order--;
+        while (order > 0 && (1u << (order - 1)) >= remaining) order--;
+
+        struct ppage *pg = alloc_block(order);
+        uint32_t take = (1u << order) < remaining ? (1u << order) : remaining;
+        trim_block(pg, order, take);
+
+        link_run(pg, take, &head, &tail);
+        remaining -= take;
+    }
+    return head;
 }
 
 void free_physical_pages(struct ppage *ppage_list) {
-    if (!ppage_list) return;
-    struct ppage *tail = ppage_list;
-    while (tail->next) tail = tail->next;
-    tail->next = free_list;
-    if (free_list) free_list->prev = tail;
-    ppage_list->prev = NULL;
-    free_list = ppage_list;
+    struct ppage *cursor = ppage_list;
+    while (cursor) {
+        // Free physically adjacent frames as one run so they merge in one go
+        uint32_t count = 1;
+        struct ppage *next = cursor->next;
+        while (next == cursor + count && next->zone == cursor->zone) {
+            count++;
+            next = next->next;
+        }
+
+        // Detach the run before its frames get reused as free list links
+        for (struct ppage *pg = cursor; pg != next; ) {
+            struct ppage *n = pg->next;
+            pg->next = NULL;
+            pg->prev = NULL;
+            pg = n;
+        }
+        free_range(&zones[cursor->zone], page_pfn(cursor), count);
+        cursor = next;
+    }
 }
 
+// Look up the ppage for a physical address, NULL if the PFA doesn't own it
+struct ppage *pfa_page_of(uintptr_t paddr) {
+    uint32_t pfn = paddr / PAGE_SIZE;
+    for (int i = 0; i < nzones; i++) {
+        if (pfn - zones[i].base_pfn < zones[i].nframes) {
+            return pfn_to_page(&zones[i], pfn);
+        }
+    }
+    return NULL;
+}
+
+unsigned int pfa_free_frames(void) {
+    return free_frames;
+}
+
+unsigned int pfa_total_frames(void) {
+    return total_frames;
+}
+
+// Everything below this physical address (from the kernel's load address
+// up) is owned by the kernel image and the allocator's own bookkeeping.
+uintptr_t pfa_reserved_end(void) {
+    return reserved_end;
+}
@@ -1,14 +1,50 @@
 #ifndef PAGE_H
 #define PAGE_H
 
+#include <stdint.h>
+
+#define PAGE_SIZE 4096
+
+// The kernel lives at the top of the address space, with all of low
+// physical memory mapped linearly from KERNEL_VIRT_BASE up.
+#define KERNEL_VIRT_BASE 0xC0000000
+#define KERNEL_LOWMEM_LIMIT 0x3FC00000   // RAM above this has no kernel mapping
+
+#define P2V(a) ((void *)((uintptr_t)(a) + KERNEL_VIRT_BASE))
+#define V2P(a) ((uintptr_t)(a) - KERNEL_VIRT_BASE)
+
+// Largest buddy block is 2^PFA_MAX_ORDER frames (4 MiB)
+#define PFA_MAX_ORDER 10
+
+// Most separate RAM ranges from the memory map we will track
+#define PFA_MAX_ZONES 16
+
+// ppage flags
+#define PPAGE_FREE 0x1   // Frame is the head of a block sitting on a free list
+
 struct ppage {
     struct ppage *next;
     struct ppage *prev;
     void *physical_addr;
+    uint8_t order;       // Block order, only meaningful on a free block's head
+    uint8_t flags;
+    uint8_t zone;        // Index of the RAM range this frame belongs to
+    uint8_t reserved;
+};
+
+// A range of usable physical RAM, [start, end)
+struct pfa_region {
+    uint32_t start;
+    uint32_t end;
 };
 
 struct ppage *allocate_physical_pages(unsigned int npages);
+struct ppage *allocate_contiguous_pages(unsigned int npages);
 void free_physical_pages(struct ppage *ppage_list);
-void init_pfa_list(void);
+struct ppage *pfa_page_of(uintptr_t paddr);
+unsigned int pfa_free_frames(void);
+unsigned int pfa_total_frames(void);
+uintptr_t pfa_reserved_end(void);
+void init_pfa_list(struct pfa_region *regions, int nregions);
 
 #endif
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include "pci.h"
+
+static inline void outl(uint16_t port, uint32_t val) {
+    asm volatile("outl %0, %1" : : "a"(val), "dN"(port));
+}
+
+static inline uint32_t inl(uint16_t port) {
+    uint32_t rv;
+    asm volatile("inl %1, %0" : "=a"(rv) : "dN"(port));
+    return rv;
+}
+
+static uint32_t pci_address(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    return 0x80000000 | ((uint32_t)bus << 16) | ((uint32_t)dev << 11) | ((uint32_t)func << 8) | (offset & 0xFC);
+}
+
+static uint32_t pci_read_raw(uint8_t bus, uint8_t dev, uint8_t func, uint8_t offset) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(bus, dev, func, offset));
+    return inl(PCI_CONFIG_DATA);
+}
+
+// Read the configuration dword at offset (rounded down to a multiple of 4)
+uint32_t pci_read(const struct pci_dev *d, uint8_t offset) {
+    return pci_read_raw(d->bus, d->dev, d->func, offset);
+}
+
+void pci_write(const struct pci_dev *d, uint8_t offset, uint32_t value) {
+    outl(PCI_CONFIG_ADDRESS, pci_address(d->bus, d->dev, d->func, offset));
+    outl(PCI_CONFIG_DATA, value);
+}
+
+// Brute force scan of every bus, device and function for the first one of
+// the given class and subclass. Returns 0 and fills in out, or -1 if there
+// isn't one.
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *out) {
+    for (uint32_t bus = 0; bus < 256; bus++) {
+        for (uint32_t dev = 0; dev < 32; dev++) {
+            for (uint32_t func = 0; func < 8; func++) {
+                uint32_t id = pci_read_raw(bus, dev, func, PCI_VENDOR_ID);
+                if ((id & 0xFFFF) == 0xFFFF) {
+                    if (func == 0)
+                        break;      // No device here at all
+                    continue;
+                }
+
+                uint32_t cls = pci_read_raw(bus, dev, func, PCI_CLASS);
+                if ((cls >> 24) == class && ((cls >> 16) & 0xFF) == subclass) {
+                    out->bus = bus;
+                    out->dev = dev;
+                    out->func = func;
+                    out->vendor = id & 0xFFFF;
+                    out->device = id >> 16;
+                    out->class = class;
+                    out->subclass = subclass;
+                    out->prog_if = (cls >> 8) & 0xFF;
+                    return 0;
+                }
+
+                // Only multifunction devices have functions past 0
+                if (func == 0 && !(pci_read_raw(bus, dev, func, PCI_HEADER_TYPE) & 0x800000))
+                    break;
+            }
+        }
+    }
+    return -1;
+}
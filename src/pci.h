@@ -0,0 +1,46 @@
+#ifndef __PCI_H__
+#define __PCI_H__
+
+#include <stdint.h>
+
+// Configuration mechanism #1
+#define PCI_CONFIG_ADDRESS 0xCF8
+#define PCI_CONFIG_DATA    0xCFC
+
+// Configuration space offsets
+#define PCI_VENDOR_ID   0x00    // Device ID in the top half
+#define PCI_COMMAND     0x04    // Status in the top half
+#define PCI_CLASS       0x08    // Class, subclass, prog IF, revision from the top down
+#define PCI_HEADER_TYPE 0x0C    // Bits 16 - 23 of this dword
+#define PCI_BAR0        0x10    // BARs 0 - 5 are 4 bytes apart
+#define PCI_INTERRUPT_LINE 0x3C // Low byte, the PIC line the BIOS routed INTx to
+
+// PCI_COMMAND bits
+#define PCI_CMD_IO          0x1
+#define PCI_CMD_MEMORY      0x2
+#define PCI_CMD_BUS_MASTER  0x4
+
+#define PCI_CLASS_STORAGE   0x01
+#define PCI_SUBCLASS_IDE    0x01
+
+// IDE controller prog IF bits
+#define PCI_IDE_PRIMARY_NATIVE  0x01    // Primary channel at BAR0/BAR1 instead of 0x1F0/0x3F6
+#define PCI_IDE_PRIMARY_SWITCH  0x02    // ...and that bit can be changed
+#define PCI_IDE_BUS_MASTER      0x80
+
+struct pci_dev {
+    uint8_t bus;
+    uint8_t dev;
+    uint8_t func;
+    uint16_t vendor;
+    uint16_t device;
+    uint8_t class;
+    uint8_t subclass;
+    uint8_t prog_if;
+};
+
+uint32_t pci_read(const struct pci_dev *d, uint8_t offset);
+void pci_write(const struct pci_dev *d, uint8_t offset, uint32_t value);
+int pci_find_class(uint8_t class, uint8_t subclass, struct pci_dev *out);
+
+#endif
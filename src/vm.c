@@ -0,0 +1,82 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "vm.h"
+#include "map.h"
+#include "page.h"
+#include "kmalloc.h"
+
+struct address_space kernel_as = { .pd = pd, .regions = NULL };
+struct address_space *current_as = &kernel_as;
+struct vm_fault_stats vm_fault_stats;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+// Reserve [start, start + len) in as. Nothing is mapped until the first
+// access to each page faults. Returns 0 on success, -1 if the range overlaps
+// an existing region, -2 if we couldn't allocate the region descriptor.
+int vm_reserve(struct address_space *as, void *start, uint32_t len, uint32_t flags) {
+    uintptr_t lo = (uintptr_t)start & ~0xFFF;
+    uintptr_t hi = ((uintptr_t)start + len + 0xFFF) & ~0xFFF;
+
+    for (struct vm_region *r = as->regions; r != NULL; r = r->next) {
+        if (lo < r->end && hi > r->start) return -1;
+    }
+
+    struct vm_region *r = kmalloc(sizeof(struct vm_region));
+    if (r == NULL) return -2;
+
+    r->start = lo;
+    r->end = hi;
+    r->flags = flags;
+    r->next = as->regions;
+    as->regions = r;
+    return 0;
+}
+
+// Called from the page fault handler with CR2 and the error code. Returns 0
+// if the fault was resolved and the faulting instruction can be retried.
+int vm_handle_fault(uintptr_t addr, uint32_t error_code) {
+    uint64_t t0 = rdtsc();
+    vm_fault_stats.faults++;
+
+    // The page is there, so this is a permission problem we can't fix
+    if (error_code & PF_PRESENT) {
+        vm_fault_stats.bad++;
+        return -1;
+    }
+
+    struct vm_region *r = current_as->regions;
+    while (r != NULL && !(addr >= r->start && addr < r->end)) r = r->next;
+    if (r == NULL ||
+        ((error_code & PF_WRITE) && !(r->flags & PAGE_RW)) ||
+        ((error_code & PF_USER) && !(r->flags & PAGE_USER))) {
+        vm_fault_stats.bad++;
+        return -1;
+    }
+
+    struct ppage *frame = allocate_physical_pages(1);
+    if (frame == NULL) {
+        vm_fault_stats.bad++;
+        return -1;
+    }
+
+    // Zero it through the kernel mapping before it becomes visible at addr
+    uint32_t *p = (uint32_t *)P2V(frame->physical_addr);
+    for (int i = 0; i < PAGE_SIZE / 4; i++) p[i] = 0;
+
+    if (map_range((void *)(addr & ~0xFFF), (uintptr_t)frame->physical_addr, PAGE_SIZE, r->flags, current_as->pd) == NULL) {
+        free_physical_pages(frame);
+        vm_fault_stats.bad++;
+        return -1;
+    }
+
+    uint64_t dt = rdtsc() - t0;
+    vm_fault_stats.resolved++;
+    vm_fault_stats.total_cycles += dt;
+    if (dt > vm_fault_stats.max_cycles) vm_fault_stats.max_cycles = dt;
+    return 0;
+}
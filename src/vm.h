@@ -0,0 +1,44 @@
+#ifndef __VM_H__
+#define __VM_H__
+
+#include <stdint.h>
+#include "map.h"
+
+// Page fault error code bits
+#define PF_PRESENT 0x1   // Fault was a protection violation, not a missing page
+#define PF_WRITE   0x2
+#define PF_USER    0x4
+
+/*
+ * A range of virtual memory that is reserved but only backed by a frame
+ * once something touches it. Frames come from the PFA zeroed.
+ *
+ */
+struct vm_region {
+    struct vm_region *next;
+    uintptr_t start;
+    uintptr_t end;       // Exclusive
+    uint32_t flags;      // PAGE_RW / PAGE_USER for pages faulted in
+};
+
+struct address_space {
+    struct page_directory_entry *pd;
+    struct vm_region *regions;
+};
+
+struct vm_fault_stats {
+    uint32_t faults;          // Every page fault taken
+    uint32_t resolved;        // Faults satisfied by mapping a zeroed frame
+    uint32_t bad;             // Faults outside any region, or protection violations
+    uint64_t total_cycles;    // TSC cycles spent in resolved faults
+    uint64_t max_cycles;
+};
+
+extern struct address_space kernel_as;
+extern struct address_space *current_as;
+extern struct vm_fault_stats vm_fault_stats;
+
+int vm_reserve(struct address_space *as, void *start, uint32_t len, uint32_t flags);
+int vm_handle_fault(uintptr_t addr, uint32_t error_code);
+
+#endif